@@ -3,32 +3,117 @@
 #include<linux/module.h>
 #include<linux/kernel.h>
 #include<linux/moduleparam.h>
+#include<linux/percpu.h>
+#include<linux/jump_label.h>
+#include<linux/string.h>
+
+#define TOWHOM_MAX 32
+#define CNT_MAX 100
 
 static char *toWhom="World";
 static int howManyTimes=1;
+static bool verbose;
 
-module_param(toWhom,charp,S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-module_param_named(cnt,howManyTimes,int,0644);
+// hot path copies: per-cpu cache of cnt and a static key for verbose,
+// both refreshed by the parameter callbacks below
+static DEFINE_PER_CPU(int, cnt_cache);
+static DEFINE_STATIC_KEY_FALSE(verbose_key);
 
-static int __init moduleparam_init(void)
+static void cnt_cache_update(int cnt)
 {
-    int i;
-     printk(KERN_INFO "%s: moduleparam_init() called\n",THIS_MODULE->name);
-    for(i=0;i<howManyTimes;i++)
+    int cpu;
+    for_each_possible_cpu(cpu)
+        per_cpu(cnt_cache, cpu) = cnt;
+}
+
+// called on insmod cnt=N and on writes to /sys/module/moduleparam/parameters/cnt
+static int cnt_set(const char *val, const struct kernel_param *kp)
+{
+    int n, ret;
+    ret = kstrtoint(val, 0, &n);
+    if(ret)
+        return ret;
+    if(n < 0 || n > CNT_MAX)
+        return -EINVAL;
+    *(int *)kp->arg = n;
+    cnt_cache_update(n);
+    printk(KERN_INFO "%s: cnt changed to %d\n",THIS_MODULE->name,n);
+    return 0;
+}
+
+static const struct kernel_param_ops cnt_ops = {
+    .set = cnt_set,
+    .get = param_get_int,
+};
+
+static int towhom_set(const char *val, const struct kernel_param *kp)
+{
+    char buf[TOWHOM_MAX + 1];
+    size_t len = strcspn(val, "\n");
+    if(len == 0 || len > TOWHOM_MAX)
+        return -EINVAL;
+    // store it without the newline echo appends
+    memcpy(buf, val, len);
+    buf[len] = '\0';
+    return param_set_charp(buf, kp);
+}
+
+static const struct kernel_param_ops towhom_ops = {
+    .set = towhom_set,
+    .get = param_get_charp,
+    .free = param_free_charp,
+};
+
+static int verbose_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_bool(val, kp);
+    if(ret)
+        return ret;
+    if(verbose)
+        static_branch_enable(&verbose_key);
+    else
+        static_branch_disable(&verbose_key);
+    return 0;
+}
+
+static const struct kernel_param_ops verbose_ops = {
+    .set = verbose_set,
+    .get = param_get_bool,
+};
+
+module_param_cb(toWhom,&towhom_ops,&toWhom,S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+module_param_cb(cnt,&cnt_ops,&howManyTimes,0644);
+module_param_cb(verbose,&verbose_ops,&verbose,0644);
+
+static void greet(const char *msg)
+{
+    int i, n;
+    // cnt comes from the local per-cpu copy
+    n = this_cpu_read(cnt_cache);
+    // toWhom may be swapped through sysfs meanwhile
+    kernel_param_lock(THIS_MODULE);
+    for(i=0;i<n;i++)
     {
-        printk(KERN_INFO "Hello %s!!\n",toWhom);
+        if(static_branch_unlikely(&verbose_key))
+            printk(KERN_INFO "%s: [%d/%d] %s %s!!\n",THIS_MODULE->name,i+1,n,msg,toWhom);
+        else
+            printk(KERN_INFO "%s %s!!\n",msg,toWhom);
     }
+    kernel_param_unlock(THIS_MODULE);
+}
+
+static int __init moduleparam_init(void)
+{
+     printk(KERN_INFO "%s: moduleparam_init() called\n",THIS_MODULE->name);
+    cnt_cache_update(howManyTimes);
+    greet("Hello");
     return 0;
 }
 
 static void __exit moduleparam_exit(void)
 {
-    int i;
     printk(KERN_INFO "%s: moduleparam_exit() called\n",THIS_MODULE->name);
-    for(i=0;i<howManyTimes;i++)
-    {
-        printk(KERN_INFO "Goodbye %s !!\n",toWhom);
-    }
+    greet("Goodbye");
 }
 
 module_init(moduleparam_init);
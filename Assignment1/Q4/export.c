@@ -1,20 +1,75 @@
 #include<linux/module.h>
 #include<linux/kernel.h>
+#include<linux/slab.h>
+#include<linux/mutex.h>
 #include "export.h"
 
 
 int num=100;
+shared_state_t __rcu *shared_state;
+// serializes publishers; readers never take it
+static DEFINE_MUTEX(publish_lock);
+static BLOCKING_NOTIFIER_HEAD(state_chain);
+
+int shared_state_publish(const void *data, size_t len)
+{
+    shared_state_t *new, *old;
+    u64 version;
+
+    new = kmalloc(struct_size(new, data, len), GFP_KERNEL);
+    if(!new)
+        return -ENOMEM;
+    new->len = len;
+    memcpy(new->data, data, len);
+
+    mutex_lock(&publish_lock);
+    old = rcu_dereference_protected(shared_state, lockdep_is_held(&publish_lock));
+    version = old ? old->version + 1 : 1;
+    new->version = version;
+    rcu_assign_pointer(shared_state, new);
+    // old readers may still hold it until the grace period ends
+    if(old)
+        kfree_rcu(old, rcu);
+    blocking_notifier_call_chain(&state_chain, version, new);
+    mutex_unlock(&publish_lock);
+
+    printk(KERN_INFO "%s: published shared state version %llu (%zu bytes)\n",THIS_MODULE->name,version,len);
+    return 0;
+}
+
+int shared_state_register_notifier(struct notifier_block *nb)
+{
+    return blocking_notifier_chain_register(&state_chain, nb);
+}
+
+int shared_state_unregister_notifier(struct notifier_block *nb)
+{
+    return blocking_notifier_chain_unregister(&state_chain, nb);
+}
+
 static int __init desd_init(void)
 {
-   
+    shared_tuning_t tuning = {
+        .log_level = 0,
+        .fifo_size = 32,
+        .timer_ms = 1000,
+    };
+
     printk(KERN_INFO "%s: desd_init() called for module with multiple exported symbols\n",THIS_MODULE->name);
     num++;
-    return 0;
+    tuning.num = num;
+    return shared_state_publish(&tuning, sizeof(tuning));
 }
 
 static void __exit desd_exit(void)
 {
+    shared_state_t *old;
+
     printk(KERN_INFO "%s: desd_exit() called for module with multiple exported symbols\n",THIS_MODULE->name);
+    // importers are gone (they hold a reference on us), wait out stray readers
+    old = rcu_replace_pointer(shared_state, NULL, true);
+    synchronize_rcu();
+    kfree(old);
 }
 void exported_fn(void)
 {
@@ -30,3 +85,7 @@ MODULE_AUTHOR("chetna <chetna7726@gmail.com>");
 
 EXPORT_SYMBOL(exported_fn);
 EXPORT_SYMBOL(num);
+EXPORT_SYMBOL_GPL(shared_state);
+EXPORT_SYMBOL_GPL(shared_state_publish);
+EXPORT_SYMBOL_GPL(shared_state_register_notifier);
+EXPORT_SYMBOL_GPL(shared_state_unregister_notifier);
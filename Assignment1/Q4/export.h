@@ -1,7 +1,42 @@
 #ifndef __EXPORT_H
 #define __EXPORT_H
 
+#include <linux/types.h>
+#include <linux/rcupdate.h>
+#include <linux/notifier.h>
+
 extern int num;
 void exported_fn(void);
 
-#endif
\ No newline at end of file
+// versioned blob published by export.ko, replaced as a whole on update
+typedef struct shared_state {
+    u64 version;
+    size_t len;
+    struct rcu_head rcu;
+    u8 data[];
+} shared_state_t;
+
+// tuning layout carried in shared_state_t.data
+typedef struct shared_tuning {
+    int num;
+    int log_level;
+    unsigned int fifo_size;
+    unsigned int timer_ms;
+} shared_tuning_t;
+
+extern shared_state_t __rcu *shared_state;
+
+// lock-free read side: call inside rcu_read_lock()/rcu_read_unlock() and
+// do not keep the pointer after unlocking; may return NULL
+static inline const shared_state_t *shared_state_get(void)
+{
+    return rcu_dereference(shared_state);
+}
+
+int shared_state_publish(const void *data, size_t len);
+// callbacks run in process context after each publish with the new
+// version as action and the new shared_state_t as data
+int shared_state_register_notifier(struct notifier_block *nb);
+int shared_state_unregister_notifier(struct notifier_block *nb);
+
+#endif
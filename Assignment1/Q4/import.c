@@ -2,16 +2,50 @@
 #include<linux/kernel.h>
 #include "export.h"
 
+// hot path style read: no locks, just an rcu read section
+static int read_tuning(shared_tuning_t *out, u64 *version)
+{
+    const shared_state_t *st;
+    int ret = -ENODATA;
+
+    rcu_read_lock();
+    st = shared_state_get();
+    if(st && st->len >= sizeof(*out)) {
+        memcpy(out, st->data, sizeof(*out));
+        *version = st->version;
+        ret = 0;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static int state_updated(struct notifier_block *nb, unsigned long version, void *data)
+{
+    const shared_state_t *st = data;
+    printk(KERN_INFO "%s: shared state updated to version %lu (%zu bytes)\n",THIS_MODULE->name,version,st->len);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block state_nb = {
+    .notifier_call = state_updated,
+};
+
 static int __init desd_init(void)
 {
+    shared_tuning_t tuning;
+    u64 version;
+
     printk(KERN_INFO "%s: desd_init() called..\n",THIS_MODULE->name);
     exported_fn();
     printk(KERN_INFO "%s: Imported symbol num=%d from export.ko\n",THIS_MODULE->name,num);
-    return 0;
+    if(read_tuning(&tuning, &version) == 0)
+        printk(KERN_INFO "%s: shared state v%llu: num=%d fifo_size=%u timer_ms=%u\n",THIS_MODULE->name,version,tuning.num,tuning.fifo_size,tuning.timer_ms);
+    return shared_state_register_notifier(&state_nb);
 }
 
 static void __exit desd_exit(void)
 {
+    shared_state_unregister_notifier(&state_nb);
     printk(KERN_INFO "%s: desd_exit() called..\n",THIS_MODULE->name);
 }
 
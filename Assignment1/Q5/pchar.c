@@ -2,15 +2,58 @@
 #include<linux/fs.h>
 #include<linux/device.h>
 #include<linux/cdev.h>
+#include<linux/mm.h>
+#include<linux/highmem.h>
+#include<linux/xarray.h>
+#include<linux/rwsem.h>
+#include<linux/hash.h>
+#include<linux/log2.h>
+#include<linux/uaccess.h>
 
 
 static dev_t dev;
 static struct cdev cdev;
 static struct class *pclass;
 
-#define MAX 32
+// store size in bytes; memory is only committed for pages that are touched
+static unsigned long size = 1UL << 30;
+module_param(size, ulong, 0444);
 
-static char mybuf[MAX];
+// page index -> struct page *, absent index is a hole that reads as zeros
+static DEFINE_XARRAY(store);
+static atomic_long_t nr_pages;
+// pages hash onto striped rw_semaphores, so I/O at disjoint offsets runs in
+// parallel and only collides when two pages share a stripe
+#define PCHAR_LOCK_STRIPES 64
+static struct pchar_stripe {
+    struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp stripes[PCHAR_LOCK_STRIPES];
+
+static struct rw_semaphore *page_lock(pgoff_t index)
+{
+    return &stripes[hash_long(index, ilog2(PCHAR_LOCK_STRIPES))].sem;
+}
+
+static struct page *pchar_get_page(pgoff_t index, bool alloc)
+{
+    struct page *page, *old;
+
+    page = xa_load(&store, index);
+    if(page || !alloc)
+        return page;
+
+    page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+    if(!page)
+        return ERR_PTR(-ENOMEM);
+    // somebody else may have populated it meanwhile (e.g. mmap fault)
+    old = xa_cmpxchg(&store, index, NULL, page, GFP_KERNEL_ACCOUNT);
+    if(old) {
+        __free_page(page);
+        return xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
+    }
+    atomic_long_inc(&nr_pages);
+    return page;
+}
 
 static int pchar_open(struct inode *pinode,struct file *pfile)
 {
@@ -27,78 +70,184 @@ static int pchar_close(struct inode *pinode, struct file *pfile)
 
 
 static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t bufsize, loff_t *pf_pos) {
-    int max_bytes, bytes_to_write, nbytes;
-    printk(KERN_INFO "%s: pchar_write() called.\n", THIS_MODULE->name);
-    // find max bytes available in mybuf
-    max_bytes = MAX - *pf_pos;
-    // calculate num of bytes to be written (min of max bytes and user buffer size)
-    bytes_to_write = (max_bytes < bufsize) ? max_bytes : bufsize;
-    // if no space left in mybuf, return 0 or error
-    if(bytes_to_write <= 0) {
-        printk(KERN_ERR "%s: pchar_write() - mybuf is full.\n", THIS_MODULE->name);
-        return -ENOSPC;
+    loff_t pos = *pf_pos;
+    size_t done = 0, chunk, left;
+    struct page *page;
+    struct rw_semaphore *lock;
+    unsigned int off;
+    void *kaddr;
+
+    // find max bytes available in the store
+    if(pos < 0)
+        return -EINVAL;
+    if(pos >= size) {
+        return bufsize ? -ENOSPC : 0;
+    }
+    bufsize = min_t(size_t, bufsize, size - pos);
+
+    // each page is updated atomically, a write spanning pages is not
+    while(done < bufsize) {
+        off = offset_in_page(pos);
+        chunk = min_t(size_t, PAGE_SIZE - off, bufsize - done);
+        page = pchar_get_page(pos >> PAGE_SHIFT, true);
+        if(IS_ERR(page)) {
+            if(!done)
+                done = PTR_ERR(page);
+            break;
+        }
+        lock = page_lock(pos >> PAGE_SHIFT);
+        down_write(lock);
+        kaddr = kmap_local_page(page);
+        left = copy_from_user(kaddr + off, ubuf + done, chunk);
+        kunmap_local(kaddr);
+        up_write(lock);
+        done += chunk - left;
+        pos += chunk - left;
+        if(left) {
+            if(!done)
+                done = -EFAULT;
+            break;
+        }
     }
-    // copy bytes from user buffer to mybuf & calculate bytes copied successfully
-    nbytes = bytes_to_write - copy_from_user(mybuf + *pf_pos, ubuf, bytes_to_write);
-    // change file pos accordingly
-    *pf_pos = *pf_pos + nbytes;
-    printk(KERN_INFO "%s: pchar_write() written %d bytes to mybuf.\n", THIS_MODULE->name, nbytes);
-    return nbytes;
+
+    if((ssize_t)done > 0)
+        *pf_pos = pos;
+    return done;
 }
 
 
 static ssize_t pchar_read(struct file *pfile,char __user* ubuf,size_t bufsize,loff_t *pf_pos)
 {
-    int max,nbytes,bytes_to_read;
-    max=MAX-*pf_pos;
-    if(max>bufsize)
-    {
-        bytes_to_read=bufsize;
-    }
-    else
-    {
-        bytes_to_read=max;
+    loff_t pos = *pf_pos;
+    size_t done = 0, chunk, left;
+    struct page *page;
+    struct rw_semaphore *lock;
+    unsigned int off;
+    void *kaddr;
+
+    if(pos < 0)
+        return -EINVAL;
+    if(pos >= size)
+        return 0;
+    bufsize = min_t(size_t, bufsize, size - pos);
+
+    while(done < bufsize) {
+        off = offset_in_page(pos);
+        chunk = min_t(size_t, PAGE_SIZE - off, bufsize - done);
+        // pages are never freed while loaded, lookup needs no lock
+        page = pchar_get_page(pos >> PAGE_SHIFT, false);
+        if(page) {
+            lock = page_lock(pos >> PAGE_SHIFT);
+            down_read(lock);
+            kaddr = kmap_local_page(page);
+            left = copy_to_user(ubuf + done, kaddr + off, chunk);
+            kunmap_local(kaddr);
+            up_read(lock);
+        } else {
+            // hole
+            left = clear_user(ubuf + done, chunk);
+        }
+        done += chunk - left;
+        pos += chunk - left;
+        if(left) {
+            if(!done)
+                done = -EFAULT;
+            break;
+        }
     }
-    if(bytes_to_read==0)
-    {
-        printk(KERN_INFO "%s: pchar_read() called\n",THIS_MODULE->name);
-        return -ENOSPC;
+
+    if((ssize_t)done > 0)
+        *pf_pos = pos;
+    return done;
+}
+
+// first offset >= pos inside a populated page
+static loff_t pchar_seek_data(loff_t pos)
+{
+    unsigned long index = pos >> PAGE_SHIFT;
+
+    if(!xa_find(&store, &index, (size - 1) >> PAGE_SHIFT, XA_PRESENT))
+        return -ENXIO;
+    return max_t(loff_t, pos, (loff_t)index << PAGE_SHIFT);
+}
+
+// first offset >= pos inside a hole, end of store counts as a hole
+static loff_t pchar_seek_hole(loff_t pos)
+{
+    unsigned long index, expected = pos >> PAGE_SHIFT;
+    struct page *page;
+
+    xa_for_each_start(&store, index, page, expected) {
+        if(index != expected)
+            break;
+        expected++;
     }
-    nbytes=bytes_to_read-copy_to_user(ubuf,mybuf + *pf_pos,bytes_to_read);
-    *pf_pos=*pf_pos+nbytes;
-    return nbytes;
+    return min_t(loff_t, max_t(loff_t, pos, (loff_t)expected << PAGE_SHIFT), size);
 }
 
 static loff_t pchar_lseek(struct file *pfile,loff_t offset,int origin)
 {
-    loff_t new_pos=0;
+    loff_t new_pos;
     switch(origin)
     {
-        case 0:
+        case SEEK_SET:
             new_pos=offset;
             break;
 
-        case 1:
-            new_pos=pfile-> f_pos+offset;
+        case SEEK_CUR:
+            new_pos=pfile->f_pos+offset;
             break;
 
-        case 3:
-            new_pos=MAX-offset;
-            break;       
-    }
-    if(new_pos>MAX)
-    {
-        new_pos=MAX;
-    }
-    if(new_pos<0)
-    {
-        new_pos=0;
+        case SEEK_END:
+            new_pos=size+offset;
+            break;
+
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            if(offset<0 || offset>=size)
+                return -ENXIO;
+            new_pos=(origin==SEEK_DATA) ? pchar_seek_data(offset) : pchar_seek_hole(offset);
+            if(new_pos<0)
+                return new_pos;
+            break;
+
+        default:
+            return -EINVAL;
     }
-    pfile->f_pos=new_pos;
-    return new_pos;
+    return vfs_setpos(pfile,new_pos,size);
 
 }
 
+static vm_fault_t pchar_vm_fault(struct vm_fault *vmf)
+{
+    struct page *page;
+
+    if(((loff_t)vmf->pgoff << PAGE_SHIFT) >= size)
+        return VM_FAULT_SIGBUS;
+    // mapped pages are populated on first touch, read or write
+    page = pchar_get_page(vmf->pgoff, true);
+    if(IS_ERR(page))
+        return VM_FAULT_OOM;
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct pchar_vm_ops = {
+    .fault = pchar_vm_fault,
+};
+
+static int pchar_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    if(((loff_t)vma->vm_pgoff << PAGE_SHIFT) + len > PAGE_ALIGN(size))
+        return -EINVAL;
+    vma->vm_ops = &pchar_vm_ops;
+    vm_flags_set(vma, VM_DONTEXPAND);
+    return 0;
+}
+
 
 static struct file_operations fs_ops={
     .owner=THIS_MODULE,
@@ -106,26 +255,39 @@ static struct file_operations fs_ops={
     .release=pchar_close,
      .write=pchar_write,
     .read=pchar_read,
-    .llseek=pchar_lseek
+    .llseek=pchar_lseek,
+    .mmap=pchar_mmap
 };
 
 static int __init pchar_init(void)
 {
     int major=250;
     int minor=0;
+    int i;
+
+    if(size==0 || size>MAX_LFS_FILESIZE)
+    {
+        return -EINVAL;
+    }
+
+    for(i=0;i<PCHAR_LOCK_STRIPES;i++)
+    {
+        init_rwsem(&stripes[i].sem);
+    }
 
     dev=MKDEV(major,minor);
     if(alloc_chrdev_region(&dev,0,1,"pchar")<0)
     {
         return -1;
     }
-    if((pclass=class_create("pchar_class"))==NULL)
+    pclass=class_create("pchar_class");
+    if(IS_ERR(pclass))
     {
         unregister_chrdev_region(dev,1);
-        return -1;
+        return PTR_ERR(pclass);
     }
 
-    if(device_create(pclass,NULL,dev,NULL,"pchar")==NULL)
+    if(IS_ERR(device_create(pclass,NULL,dev,NULL,"pchar")))
     {
         class_destroy(pclass);
         unregister_chrdev_region(dev,1);
@@ -133,7 +295,7 @@ static int __init pchar_init(void)
     }
 
     cdev_init(&cdev,&fs_ops);
-    if(cdev_add(&cdev,dev,1)==-1)
+    if(cdev_add(&cdev,dev,1)<0)
     {
         device_destroy(pclass,dev);
         class_destroy(pclass);
@@ -141,17 +303,27 @@ static int __init pchar_init(void)
         return -1;
     }
 
-    printk(KERN_INFO "%s : Character device driver is successfully registered\n",THIS_MODULE->name);
+    printk(KERN_INFO "%s : Character device driver is successfully registered, store size %lu bytes\n",THIS_MODULE->name,size);
 
     return 0;
 }
 
 static void __exit pchar_exit(void)
 {
+    struct page *page;
+    unsigned long index;
+
     cdev_del(&cdev);
     device_destroy(pclass,dev);
     class_destroy(pclass);
     unregister_chrdev_region(dev,1);
+
+    printk(KERN_INFO "%s: releasing %ld populated pages\n",THIS_MODULE->name,atomic_long_read(&nr_pages));
+    xa_for_each(&store,index,page)
+    {
+        __free_page(page);
+    }
+    xa_destroy(&store);
     printk(KERN_INFO "%s: Goodbye: Character device driver successfully unregistered\n",THIS_MODULE->name);
 }
 
@@ -0,0 +1,123 @@
+// user space scaling test for /dev/pchar
+// each thread does pwrite/pread of blksz bytes at random offsets inside its
+// own disjoint region; run with 1, 2, 4 ... maxthreads threads
+//
+// usage: ./pchar_bench [device] [maxthreads] [ops per thread] [blksz]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define REGION (16UL << 20)     // bytes per thread
+
+static const char *devpath = "/dev/pchar";
+static long nops = 100000;
+static size_t blksz = 4096;
+
+typedef struct worker {
+    pthread_t tid;
+    int fd;
+    int id;
+    long errors;
+}worker_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_fn(void *arg)
+{
+    worker_t *w = arg;
+    unsigned int seed = w->id + 1;
+    off_t base = (off_t)w->id * REGION, off;
+    char *buf;
+    long i;
+
+    buf = malloc(blksz);
+    if(!buf) {
+        w->errors++;
+        return NULL;
+    }
+    memset(buf, 'a' + w->id % 26, blksz);
+    for(i = 0; i < nops; i++) {
+        off = base + (rand_r(&seed) % (REGION / blksz)) * blksz;
+        // half writes, half reads
+        if(i & 1) {
+            if(pread(w->fd, buf, blksz, off) != (ssize_t)blksz)
+                w->errors++;
+        } else {
+            if(pwrite(w->fd, buf, blksz, off) != (ssize_t)blksz)
+                w->errors++;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int run(int nthreads)
+{
+    worker_t *w;
+    double t;
+    long errors = 0;
+    int i, fd;
+
+    fd = open(devpath, O_RDWR);
+    if(fd < 0) {
+        perror("open");
+        return -1;
+    }
+    w = calloc(nthreads, sizeof(*w));
+    if(!w) {
+        close(fd);
+        return -1;
+    }
+
+    t = now_sec();
+    for(i = 0; i < nthreads; i++) {
+        w[i].fd = fd;
+        w[i].id = i;
+        pthread_create(&w[i].tid, NULL, worker_fn, &w[i]);
+    }
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        errors += w[i].errors;
+    }
+    t = now_sec() - t;
+
+    printf("threads %3d  %10.0f ops/s  %8.1f MiB/s  errors %ld\n", nthreads,
+           nthreads * nops / t, nthreads * nops * (double)blksz / t / (1 << 20), errors);
+    free(w);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int n;
+
+    if(argc > 1)
+        devpath = argv[1];
+    if(argc > 2)
+        maxthreads = atoi(argv[2]);
+    if(argc > 3)
+        nops = atol(argv[3]);
+    if(argc > 4)
+        blksz = strtoul(argv[4], NULL, 0);
+    if(maxthreads < 1 || nops < 1 || blksz < 1 || blksz > REGION) {
+        fprintf(stderr, "usage: %s [device] [maxthreads] [ops per thread] [blksz]\n", argv[0]);
+        return 1;
+    }
+    // device must be at least maxthreads * 16 MiB (size= module param)
+    for(n = 1; n <= maxthreads; n *= 2) {
+        if(run(n) < 0)
+            return 1;
+    }
+    return 0;
+}
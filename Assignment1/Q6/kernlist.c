@@ -1,3 +1,282 @@
 #include<linux/module.h>
 #include<linux/list.h>
-#include<linux/slab.h>
\ No newline at end of file
+#include<linux/slab.h>
+#include<linux/xarray.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/sched.h>
+
+// benchmark of list_head nodes vs chunked array list vs xarray
+// for the same insert / iterate / delete-by-key workload
+
+#define CHUNK_ENTRIES 62    // keeps struct kchunk at 1 KiB
+#define SCAN_BUDGET 100000000ULL
+
+// element counts run from 10^min_order to 10^max_order
+static int min_order = 3;
+module_param(min_order, int, 0444);
+static int max_order = 6;
+module_param(max_order, int, 0444);
+static int nr_deletes = 1000;
+module_param(nr_deletes, int, 0444);
+
+typedef struct knode {
+    struct list_head list;
+    u64 key;
+    u64 val;
+}knode_t;
+
+typedef struct kchunk {
+    struct list_head list;
+    unsigned int cnt;
+    u64 keys[CHUNK_ENTRIES];
+    u64 vals[CHUNK_ENTRIES];
+}kchunk_t;
+
+typedef struct kresult {
+    u64 insert_ns;
+    u64 iter_ns;
+    u64 delete_ns;
+    int deletes;
+    u64 sum;
+}kresult_t;
+
+static struct kmem_cache *node_cache;
+static struct kmem_cache *chunk_cache;
+
+static u64 key_seed;
+
+// deterministic key sequence so all structures delete the same keys
+static u64 next_key(u64 n)
+{
+    u64 rem;
+    key_seed = key_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    div64_u64_rem(key_seed >> 17, n, &rem);
+    return rem;
+}
+
+static void maybe_resched(u64 i)
+{
+    if((i & 4095) == 0)
+        cond_resched();
+}
+
+/* list_head: one slab object per element */
+static int bench_list(u64 n, int deletes, kresult_t *res)
+{
+    LIST_HEAD(head);
+    knode_t *node, *tmp;
+    u64 i, t, key, sum = 0;
+    int d, ret = 0;
+
+    t = ktime_get_ns();
+    for(i = 0; i < n; i++) {
+        node = kmem_cache_alloc(node_cache, GFP_KERNEL);
+        if(!node) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        node->key = i;
+        node->val = i;
+        list_add_tail(&node->list, &head);
+        maybe_resched(i);
+    }
+    res->insert_ns = ktime_get_ns() - t;
+
+    t = ktime_get_ns();
+    list_for_each_entry(node, &head, list)
+        sum += node->val;
+    res->iter_ns = ktime_get_ns() - t;
+
+    t = ktime_get_ns();
+    for(d = 0; d < deletes; d++) {
+        key = next_key(n);
+        list_for_each_entry(node, &head, list) {
+            if(node->key == key) {
+                list_del(&node->list);
+                kmem_cache_free(node_cache, node);
+                break;
+            }
+        }
+        maybe_resched(d);
+    }
+    res->delete_ns = ktime_get_ns() - t;
+    res->sum = sum;
+out:
+    list_for_each_entry_safe(node, tmp, &head, list) {
+        list_del(&node->list);
+        kmem_cache_free(node_cache, node);
+    }
+    return ret;
+}
+
+/* chunked array list: CHUNK_ENTRIES keys scanned per pointer hop */
+static int bench_chunks(u64 n, int deletes, kresult_t *res)
+{
+    LIST_HEAD(head);
+    kchunk_t *chunk = NULL, *last, *tmp;
+    u64 i, t, key, sum = 0;
+    unsigned int j;
+    int d, ret = 0;
+
+    t = ktime_get_ns();
+    for(i = 0; i < n; i++) {
+        if(!chunk || chunk->cnt == CHUNK_ENTRIES) {
+            chunk = kmem_cache_alloc(chunk_cache, GFP_KERNEL);
+            if(!chunk) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            chunk->cnt = 0;
+            list_add_tail(&chunk->list, &head);
+        }
+        chunk->keys[chunk->cnt] = i;
+        chunk->vals[chunk->cnt] = i;
+        chunk->cnt++;
+        maybe_resched(i);
+    }
+    res->insert_ns = ktime_get_ns() - t;
+
+    t = ktime_get_ns();
+    list_for_each_entry(chunk, &head, list) {
+        for(j = 0; j < chunk->cnt; j++)
+            sum += chunk->vals[j];
+    }
+    res->iter_ns = ktime_get_ns() - t;
+
+    // delete fills the hole with the last element, order is not kept
+    t = ktime_get_ns();
+    for(d = 0; d < deletes; d++) {
+        key = next_key(n);
+        list_for_each_entry(chunk, &head, list) {
+            for(j = 0; j < chunk->cnt; j++) {
+                if(chunk->keys[j] != key)
+                    continue;
+                last = list_last_entry(&head, kchunk_t, list);
+                last->cnt--;
+                chunk->keys[j] = last->keys[last->cnt];
+                chunk->vals[j] = last->vals[last->cnt];
+                if(last->cnt == 0) {
+                    list_del(&last->list);
+                    kmem_cache_free(chunk_cache, last);
+                }
+                goto next;
+            }
+        }
+next:
+        maybe_resched(d);
+    }
+    res->delete_ns = ktime_get_ns() - t;
+    res->sum = sum;
+out:
+    list_for_each_entry_safe(chunk, tmp, &head, list) {
+        list_del(&chunk->list);
+        kmem_cache_free(chunk_cache, chunk);
+    }
+    return ret;
+}
+
+/* xarray indexed by key, values stored inline */
+static int bench_xarray(u64 n, int deletes, kresult_t *res)
+{
+    DEFINE_XARRAY(xa);
+    unsigned long index;
+    void *entry;
+    u64 i, t, sum = 0;
+    int d, ret = 0;
+
+    t = ktime_get_ns();
+    for(i = 0; i < n; i++) {
+        ret = xa_err(xa_store(&xa, i, xa_mk_value(i), GFP_KERNEL));
+        if(ret)
+            goto out;
+        maybe_resched(i);
+    }
+    res->insert_ns = ktime_get_ns() - t;
+
+    t = ktime_get_ns();
+    xa_for_each(&xa, index, entry)
+        sum += xa_to_value(entry);
+    res->iter_ns = ktime_get_ns() - t;
+
+    t = ktime_get_ns();
+    for(d = 0; d < deletes; d++)
+        xa_erase(&xa, next_key(n));
+    res->delete_ns = ktime_get_ns() - t;
+    res->sum = sum;
+out:
+    xa_destroy(&xa);
+    return ret;
+}
+
+static void report(const char *name, u64 n, int ret, kresult_t *res)
+{
+    if(ret) {
+        pr_info("%s: %-8s n=%-9llu failed (%d)\n", THIS_MODULE->name, name, n, ret);
+        return;
+    }
+    pr_info("%s: %-8s n=%-9llu insert %6llu ns/op  iterate %6llu ps/elem  delete %9llu ns/op (%d keys) sum=%llu\n",
+            THIS_MODULE->name, name, n, div64_u64(res->insert_ns, n), div64_u64(res->iter_ns * 1000, n),
+            div_u64(res->delete_ns, res->deletes), res->deletes, res->sum);
+}
+
+static int __init kernlist_init(void)
+{
+    kresult_t res;
+    u64 n, seed;
+    int order, deletes, ret;
+
+    pr_info("%s: kernlist_init() called\n", THIS_MODULE->name);
+    min_order = clamp(min_order, 1, 7);
+    max_order = clamp(max_order, min_order, 7);
+    nr_deletes = max(nr_deletes, 1);
+
+    node_cache = kmem_cache_create("kernlist_node", sizeof(knode_t), 0, 0, NULL);
+    chunk_cache = kmem_cache_create("kernlist_chunk", sizeof(kchunk_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if(!node_cache || !chunk_cache) {
+        pr_err("%s: kmem_cache_create() failed.\n", THIS_MODULE->name);
+        kmem_cache_destroy(node_cache);
+        kmem_cache_destroy(chunk_cache);
+        return -ENOMEM;
+    }
+
+    for(order = min_order; order <= max_order; order++) {
+        n = int_pow(10, order);
+        // list deletes scan O(n) each, bound the total scan work
+        deletes = min_t(u64, nr_deletes, max_t(u64, SCAN_BUDGET / n, 10));
+        seed = n;
+
+        memset(&res, 0, sizeof(res));
+        res.deletes = deletes;
+        key_seed = seed;
+        ret = bench_list(n, deletes, &res);
+        report("list", n, ret, &res);
+
+        memset(&res, 0, sizeof(res));
+        res.deletes = deletes;
+        key_seed = seed;
+        ret = bench_chunks(n, deletes, &res);
+        report("chunked", n, ret, &res);
+
+        memset(&res, 0, sizeof(res));
+        res.deletes = deletes;
+        key_seed = seed;
+        ret = bench_xarray(n, deletes, &res);
+        report("xarray", n, ret, &res);
+    }
+    return 0;
+}
+
+static void __exit kernlist_exit(void)
+{
+    pr_info("%s: kernlist_exit() called\n", THIS_MODULE->name);
+    kmem_cache_destroy(node_cache);
+    kmem_cache_destroy(chunk_cache);
+}
+
+module_init(kernlist_init);
+module_exit(kernlist_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Kernel list vs chunked array vs xarray benchmark");
+MODULE_AUTHOR("chetna <chetna7726@gmail.com>");
@@ -1,27 +1,274 @@
 #include<linux/module.h>
 #include<linux/list.h>
 #include<linux/slab.h>
-#include<linux/shed/task.>
+#include<linux/fs.h>
+#include<linux/device.h>
+#include<linux/cdev.h>
+#include<linux/hashtable.h>
+#include<linux/mutex.h>
+#include<linux/workqueue.h>
+#include<linux/sched/signal.h>
+#include<linux/sched/task.h>
 
+#define TOPN_MAX 64
+#define TOP_LINE 64
+
+// sampling interval and number of consumers reported
+static int interval_ms = 1000;
+module_param(interval_ms, int, 0644);
+static int topn = 10;
+module_param(topn, int, 0644);
+
+// previous sample of a process, keyed by pid and start time so a reused
+// pid is not mistaken for the process that had it before
+typedef struct ptask {
+    struct hlist_node node;
+    pid_t pid;
+    u64 start_time;
+    u64 last_ns;
+    u64 delta_ns;
+    u64 round;
+    char comm[TASK_COMM_LEN];
+}ptask_t;
+
+// snapshot formatted at open() and served by read()
+typedef struct ptop_snap {
+    int len;
+    char buf[];
+}ptop_snap_t;
+
+typedef struct ptop {
+    pid_t pid;
+    u64 delta_ns;
+    char comm[TASK_COMM_LEN];
+}ptop_t;
+
+static DEFINE_HASHTABLE(ptasks, 10);
+static DEFINE_MUTEX(ptop_lock);
+static u64 round_no;
+static u64 round_ns;    // start of the current sampling window
+static u64 window_ns;   // length of the window the deltas cover
+static ptop_t top[TOPN_MAX];
+static int top_cnt;
+static struct delayed_work top_work;
+
+static dev_t devno;
+static int major;
+static struct class *pclass;
+static struct cdev ptop_cdev;
+
+// thread group cpu time; an exiting thread moves its times into signal under
+// stats_lock, retry so it is not counted twice (as thread_group_cputime())
+static u64 ptop_cputime(struct task_struct *p)
+{
+    struct signal_struct *sig = p->signal;
+    struct task_struct *t;
+    unsigned int seq;
+    u64 sum;
+
+    do {
+        seq = read_seqbegin(&sig->stats_lock);
+        sum = sig->utime + sig->stime;
+        for_each_thread(p, t)
+            sum += READ_ONCE(t->utime) + READ_ONCE(t->stime);
+    } while(read_seqretry(&sig->stats_lock, seq));
+    return sum;
+}
+
+static ptask_t *ptop_lookup(pid_t pid, u64 start_time)
+{
+    ptask_t *pt;
+    hash_for_each_possible(ptasks, pt, node, pid) {
+        if(pt->pid == pid && pt->start_time == start_time)
+            return pt;
+    }
+    return NULL;
+}
+
+// keep top[] sorted by delta, largest first
+static void ptop_insert(ptask_t *pt, int n)
+{
+    int i;
+    if(pt->delta_ns == 0)
+        return;
+    if(top_cnt == n && top[n - 1].delta_ns >= pt->delta_ns)
+        return;
+    i = (top_cnt < n) ? top_cnt++ : n - 1;
+    while(i > 0 && top[i - 1].delta_ns < pt->delta_ns) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i].pid = pt->pid;
+    top[i].delta_ns = pt->delta_ns;
+    memcpy(top[i].comm, pt->comm, TASK_COMM_LEN);
+}
+
+static void ptop_sample(struct work_struct *work)
+{
+    struct task_struct *trav;
+    struct hlist_node *tmp;
+    ptask_t *pt;
+    u64 now, cpu;
+    int bkt, n, ms;
+
+    n = clamp(READ_ONCE(topn), 1, TOPN_MAX);
+    mutex_lock(&ptop_lock);
+    round_no++;
+    now = ktime_get_ns();
+
+    rcu_read_lock();
+    for_each_process(trav) {
+        cpu = ptop_cputime(trav);
+        pt = ptop_lookup(trav->pid, trav->start_time);
+        if(!pt) {
+            // first sighting, no delta yet; an entry left by an earlier
+            // owner of the pid is not refreshed and dropped below
+            pt = kmalloc(sizeof(ptask_t), GFP_ATOMIC);
+            if(!pt)
+                continue;
+            pt->pid = trav->pid;
+            pt->start_time = trav->start_time;
+            pt->last_ns = cpu;
+            hash_add(ptasks, &pt->node, pt->pid);
+        }
+        // never let a sample below the last one wrap into a huge delta
+        pt->delta_ns = cpu > pt->last_ns ? cpu - pt->last_ns : 0;
+        pt->last_ns = max(cpu, pt->last_ns);
+        pt->round = round_no;
+        memcpy(pt->comm, trav->comm, TASK_COMM_LEN);
+    }
+    rcu_read_unlock();
+
+    // drop exited processes and rebuild the top-N table
+    top_cnt = 0;
+    hash_for_each_safe(ptasks, bkt, tmp, pt, node) {
+        if(pt->round != round_no) {
+            hash_del(&pt->node);
+            kfree(pt);
+            continue;
+        }
+        ptop_insert(pt, n);
+    }
+    window_ns = round_ns ? now - round_ns : 0;
+    round_ns = now;
+    mutex_unlock(&ptop_lock);
+
+    ms = max(READ_ONCE(interval_ms), 10);
+    schedule_delayed_work(&top_work, msecs_to_jiffies(ms));
+}
+
+// device operations
+static int ptop_open(struct inode *pinode, struct file *pfile)
+{
+    ptop_snap_t *snap;
+    int i, len;
+
+    snap = kmalloc(sizeof(ptop_snap_t) + (TOPN_MAX + 2) * TOP_LINE, GFP_KERNEL);
+    if(!snap)
+        return -ENOMEM;
+    mutex_lock(&ptop_lock);
+    len = scnprintf(snap->buf, TOP_LINE, "window %llu ns\n", window_ns);
+    len += scnprintf(snap->buf + len, TOP_LINE, "%-8s %-16s %s\n", "PID", "COMMAND", "CPU_NS");
+    for(i = 0; i < top_cnt; i++)
+        len += scnprintf(snap->buf + len, TOP_LINE, "%-8d %-16s %llu\n", top[i].pid, top[i].comm, top[i].delta_ns);
+    mutex_unlock(&ptop_lock);
+
+    snap->len = len;
+    pfile->private_data = snap;
+    return 0;
+}
+
+static int ptop_close(struct inode *pinode, struct file *pfile)
+{
+    kfree(pfile->private_data);
+    return 0;
+}
+
+static ssize_t ptop_read(struct file *pfile, char __user *ubuf, size_t bufsize, loff_t *pf_pos)
+{
+    ptop_snap_t *snap = pfile->private_data;
+    return simple_read_from_buffer(ubuf, bufsize, pf_pos, snap->buf, snap->len);
+}
+
+static struct file_operations ptop_fops = {
+    .owner = THIS_MODULE,
+    .open = ptop_open,
+    .release = ptop_close,
+    .read = ptop_read,
+    .llseek = default_llseek
+};
 
 static int __init desd_init(void)
 {
-    struct task_struct *trav=current;
+    int ret;
+    struct device *pdevice;
+
     pr_info("%s: desd_init() called\n",THIS_MODULE->name);
-    list_for_each_entry(trav,&init,task.tasks,tasks);
-     pr_info("%s: pid=%d,cmd=%d\n",THIS_MODULE->name,trav->pid,trav->comm);
+
+    ret = alloc_chrdev_region(&devno, 0, 1, "ptop");
+    if(ret != 0) {
+        pr_err("%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
+        return ret;
+    }
+    major = MAJOR(devno);
+
+    pclass = class_create("ptop_class");
+    if(IS_ERR(pclass)) {
+        pr_err("%s: class_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pclass);
+        goto class_create_failed;
+    }
+
+    pdevice = device_create(pclass, NULL, devno, NULL, "ptop");
+    if(IS_ERR(pdevice)) {
+        pr_err("%s: device_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pdevice);
+        goto device_create_failed;
+    }
+
+    ptop_cdev.owner = THIS_MODULE;
+    cdev_init(&ptop_cdev, &ptop_fops);
+    ret = cdev_add(&ptop_cdev, devno, 1);
+    if(ret != 0) {
+        pr_err("%s: cdev_add() failed.\n", THIS_MODULE->name);
+        goto cdev_add_failed;
+    }
+
+    INIT_DELAYED_WORK(&top_work, ptop_sample);
+    schedule_delayed_work(&top_work, 0);
     return 0;
+
+cdev_add_failed:
+    device_destroy(pclass, devno);
+device_create_failed:
+    class_destroy(pclass);
+class_create_failed:
+    unregister_chrdev_region(devno, 1);
+    return ret;
 }
 
-static void __exit desd_init(void)
+static void __exit desd_exit(void)
 {
+    struct hlist_node *tmp;
+    ptask_t *pt;
+    int bkt;
+
     pr_info("%s: desd_exit() called\n",THIS_MODULE->name);
-    pr_info("%s: current process pid=%d,cmd=%s\n",THIS_MODULE->name,current->pid,current->comm);
+    cancel_delayed_work_sync(&top_work);
+    cdev_del(&ptop_cdev);
+    device_destroy(pclass, devno);
+    class_destroy(pclass);
+    unregister_chrdev_region(devno, 1);
+
+    hash_for_each_safe(ptasks, bkt, tmp, pt, node) {
+        hash_del(&pt->node);
+        kfree(pt);
+    }
 }
 
 module_init(desd_init);
 module_exit(desd_exit);
 
 MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION("Kernel module demo of Display Process list (Job Queue)");
+MODULE_DESCRIPTION("Kernel module demo of top-N cpu consumers from the process list");
 MODULE_AUTHOR("chetna <chetna7726@gmail.com>");
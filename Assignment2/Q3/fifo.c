@@ -1,243 +1,134 @@
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <linux/device.h>
-#include <linux/cdev.h>
-#include <linux/kfifo.h>
-#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/cred.h>
+#include <linux/log2.h>
+#include "pchar_core.h"
 #include "pchar_ioctl.h"
 
 // pseudo char device
 #define MAX 32
-static struct kfifo mybuf; // FIFO buffer for our device
-#define TMAX 32
-static struct kfifo temp_buf;
-
-
-// device number
-static dev_t devno;
-static int major = 250;
-// device class
-static struct class *pclass;
-// device struct - cdev
-static struct cdev pchar_cdev;
-// device operations
-
-static int pchar_open(struct inode *pinode, struct file *pfile) {
-    printk(KERN_INFO "%s: pchar_open() called.\n", THIS_MODULE->name);
-    return 0;
-}
-
-static int pchar_close(struct inode *pinode, struct file *pfile) {
-    printk(KERN_INFO "%s: pchar_close() called.\n", THIS_MODULE->name);
-    return 0;
-}
 
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t bufsize, loff_t *pf_pos) {
-    int nbytes, ret;
-    printk(KERN_INFO "%s: pchar_write() called.\n", THIS_MODULE->name);
-    // copy data from user buf to kfifo mybuf
-    ret = kfifo_from_user(&mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0) {
-        printk(KERN_INFO "%s: kfifo_from_user() failed.\n", THIS_MODULE->name);
-        return ret;
-    }
-    printk(KERN_INFO "%s: pchar_write() written %d bytes to mybuf.\n", THIS_MODULE->name, nbytes);
-    return nbytes;
-}
+// registration, data path, poll, eventfd/SIGIO and FIFO_CLEAR/FIFO_GETINFO/
+// PCHAR_SET_EVENTFD live in pchar_core; reads and writes never wait
+static pchar_core_t *pchar_core;
+// the single device while registered; protects it and fifo_size against
+// concurrent resize
+static DEFINE_MUTEX(fifo_lock);
+static pchar_core_dev_t *fifo_dev;
 
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t bufsize, loff_t *pf_pos) {
-    int ret, nbytes;
-    printk(KERN_INFO "%s: pchar_read() called.\n", THIS_MODULE->name);
-    
-    // copy data from kfifo mybuf to user buf
-    ret = kfifo_to_user(&mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0) {
-        printk(KERN_ERR "%s: kfifo_to_user() failed.\n", THIS_MODULE->name);
-        return ret;
-    }
-    printk(KERN_INFO "%s: pchar_read() read %d bytes from mybuf.\n", THIS_MODULE->name, nbytes);
-    return nbytes;
-}
+// runtime tunable: /sys/module/fifo/parameters/fifo_size; pchar_dbg() logging
+// is switched by /sys/module/pchar_core/parameters/debug
+static unsigned int fifo_size = MAX;
 
-static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param) 
+static int fifo_size_set(const char *val, const struct kernel_param *kp)
 {
-    
-    devinfo_t info;
+    unsigned int size;
     int ret;
-    switch (cmd) 
-    {
-    case FIFO_CLEAR:
-        kfifo_reset(&mybuf);
-        printk(KERN_INFO "%s: pchar_ioctl() dev buffer is cleared.\n", THIS_MODULE->name);
-        return 0;
-
-    case FIFO_GETINFO:
-        info.size = kfifo_size(&mybuf);
-        info.len = kfifo_len(&mybuf);
-        info.avail = kfifo_avail(&mybuf);
-        ret = copy_to_user((void *)param, &info, sizeof(info));
-        if (ret < 0) 
-        {
-            printk(KERN_ERR "%s: copy_to_user() failed in pchar_ioctl().\n", THIS_MODULE->name);
-            return ret;
-        }
-        printk(KERN_INFO "%s: pchar_ioctl() read dev buffer info.\n", THIS_MODULE->name);
-        return 0;
-
-    case FIFREEZE: 
-        // Allocate a temp array to store the current FIFO data
-        int current_size = kfifo_len(&mybuf);
-        
-        char *temp_buf = kmalloc(current_size, GFP_KERNEL);
-        if (!temp_buf)
-         {
-            printk(KERN_ERR "%s: kmalloc() failed for temp buffer.\n", THIS_MODULE->name);
-            return -ENOMEM;
-        }
 
-        // Copy data from the current FIFO into the temp buffer
-        ret = kfifo_out(&mybuf, temp_buf, current_size);
-        if (ret != current_size)
-         {
-            printk(KERN_ERR "%s: kfifo_out() failed, could not read all data.\n", THIS_MODULE->name);
-            kfree(temp_buf);
-            return -EIO;
-        }
+    ret = kstrtouint(val, 0, &size);
+    if (ret)
+        return ret;
+    if (size < PCHAR_CORE_FIFO_MIN || size > PCHAR_CORE_FIFO_MAX)
+        return -EINVAL;
+    // before init just record it, afterwards resize in place
+    mutex_lock(&fifo_lock);
+    if (fifo_dev)
+        ret = pchar_core_resize(fifo_dev, size);
+    if (ret == 0)
+        fifo_size = size;
+    mutex_unlock(&fifo_lock);
+    return ret;
+}
 
-        pr_info("%s: kfifo_out() created,read all data from mybuf.\n",THIS_MODULE->name);
+static const struct kernel_param_ops fifo_size_ops = {
+    .set = fifo_size_set,
+    .get = param_get_uint,
+};
+module_param_cb(fifo_size, &fifo_size_ops, &fifo_size, 0644);
 
-        // Free the current FIFO buffer
-        kfifo_free(&mybuf);
+// FIFREEZE charges the whole ring to the calling uid, so with one ring the
+// per-uid quota is a cap on the size it may ask for; 0 means no limit
+static unsigned int uid_quota;
+module_param(uid_quota, uint, 0644);
 
-        // Allocate a new FIFO with the requested size (from param)
-        ret = kfifo_alloc(&mybuf, param, GFP_KERNEL);
-        if (ret != 0) 
-        {
-            printk(KERN_ERR "%s: kfifo_alloc() failed with new size %ld.\n", THIS_MODULE->name, param);
-            kfree(temp_buf);
-            return ret;
-        }
+// runs before the core's commands; everything but FIFREEZE is left to the core
+static long fifo_ioctl(pchar_core_dev_t *pdev, unsigned int cmd, unsigned long param)
+{
+    unsigned int quota;
+    int ret;
 
-        // Copy the data from the temp buffer back into the new FIFO
-        ret = kfifo_in(&mybuf, temp_buf, current_size);
-        if (ret != current_size) 
+    switch (cmd)
+    {
+    case FIFREEZE:
+        // resize to the requested size (from param), keeping queued data
+        if (param < PCHAR_CORE_FIFO_MIN || param > PCHAR_CORE_FIFO_MAX)
+            return -EINVAL;
+        quota = READ_ONCE(uid_quota);
+        if (quota && roundup_pow_of_two(param) > quota)
         {
-            printk(KERN_ERR "%s: kfifo_in() failed, could not write all data.\n", THIS_MODULE->name);
-            kfifo_free(&mybuf);
-            kfree(temp_buf);
-            return -EIO;
+            pr_err_ratelimited("%s: uid %u over quota resizing to %lu.\n", THIS_MODULE->name,
+                               from_kuid(&init_user_ns, current_uid()), param);
+            return -EDQUOT;
         }
-
-        // Free the temp buffer
-        kfree(temp_buf);
-
-        printk(KERN_INFO "%s: FIFO resized to %ld bytes, data copied back.\n", THIS_MODULE->name, param);
-        return 0;
-    
+        mutex_lock(&fifo_lock);
+        ret = pchar_core_resize(pdev, param);
+        if (ret == 0)
+            fifo_size = param;
+        mutex_unlock(&fifo_lock);
+        pchar_dbg("fifo_ioctl() resize to %lu returned %d.\n", param, ret);
+        return ret;
 
     default:
-      printk(KERN_ERR "%s: invalid command in pchar_ioctl().\n", THIS_MODULE->name);
-        return -EINVAL; // invalid command
+        return -ENOIOCTLCMD;
     }
 }
 
+static const pchar_core_ops_t fifo_ops = {
+    .ioctl = fifo_ioctl,
+};
 
-static struct file_operations pchar_fops = {
+// one device, /dev/pchar; fifo_size filled in at init
+static pchar_core_desc_t fifo_desc = {
     .owner = THIS_MODULE,
-    .open = pchar_open,
-    .release = pchar_close,
-    .write = pchar_write,
-    .read = pchar_read,
-    .unlocked_ioctl = pchar_ioctl
+    .name = "pchar",
+    .ndevs = 1,
+    .ops = &fifo_ops,
 };
 
-static int __init pchar_init(void) 
+static int __init pchar_init(void)
 {
-    int ret;
-    struct device *pdevice;
+    int ret = 0;
 
     printk(KERN_INFO "%s: pchar_init() called.\n", THIS_MODULE->name);
 
-    // allocate device number
-    devno = MKDEV(major, 0);
-    ret = alloc_chrdev_region(&devno, 0, 1, "pchar");
-    if (ret != 0) {
-        printk(KERN_ERR "%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
-        return ret;
-    }
-    major = MAJOR(devno);
-    printk(KERN_INFO "%s: alloc_chrdev_region() device num: %d.\n", THIS_MODULE->name, major);
-
-    // create device class
-    pclass = class_create("pchar_class");
-    if (IS_ERR(pclass)) {
-        printk(KERN_ERR "%s: class_create() failed.\n", THIS_MODULE->name);
-        unregister_chrdev_region(devno, 1);
-        return -1;
-    }
-    printk(KERN_INFO "%s: class_create() created pchar_class.\n", THIS_MODULE->name);
-
-    // create device file
-    pdevice = device_create(pclass, NULL, devno, NULL, "pchar");
-    if (IS_ERR(pdevice)) {
-        printk(KERN_ERR "%s: device_create() failed.\n", THIS_MODULE->name);
-        class_destroy(pclass);
-        unregister_chrdev_region(devno, 1);
-        return -1;
+    // fifo_size writes wait until the device is up, then resize it
+    mutex_lock(&fifo_lock);
+    fifo_desc.fifo_size = fifo_size;
+    pchar_core = pchar_core_register(&fifo_desc);
+    if (IS_ERR(pchar_core)) {
+        printk(KERN_ERR "%s: pchar_core_register() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pchar_core);
+        goto out;
     }
-    printk(KERN_INFO "%s: device_create() created pchar device.\n", THIS_MODULE->name);
-
-    // initialize cdev object and add it in kernel
-    pchar_cdev.owner = THIS_MODULE;
-    cdev_init(&pchar_cdev, &pchar_fops);
-    ret = cdev_add(&pchar_cdev, devno, 1);
-    if (ret != 0) {
-        printk(KERN_ERR "%s: cdev_add() failed.\n", THIS_MODULE->name);
-        device_destroy(pclass, devno);
-        class_destroy(pclass);
-        unregister_chrdev_region(devno, 1);
-        return -1;
-    }
-    printk(KERN_INFO "%s: cdev_add() added device in kernel.\n", THIS_MODULE->name);
-
-    // allocate kfifo
-    ret = kfifo_alloc(&mybuf, MAX, GFP_KERNEL);
-    if (ret != 0) {
-        printk(KERN_ERR "%s: kfifo_alloc() failed.\n", THIS_MODULE->name);
-        cdev_del(&pchar_cdev);
-        device_destroy(pclass, devno);
-        class_destroy(pclass);
-        unregister_chrdev_region(devno, 1);
-        return ret;
-    }
-    printk(KERN_INFO "%s: kfifo_alloc() allocated fifo of size %d.\n", THIS_MODULE->name, kfifo_size(&mybuf));
-
-    return 0;
+    fifo_dev = pchar_core_dev(pchar_core, 0);
+    printk(KERN_INFO "%s: pchar device registered with fifo of size %u.\n", THIS_MODULE->name,
+           kfifo_size(&fifo_dev->fifo));
+out:
+    mutex_unlock(&fifo_lock);
+    return ret;
 }
 
 static void __exit pchar_exit(void)
- {
+{
     printk(KERN_INFO "%s: pchar_exit() called.\n", THIS_MODULE->name);
 
-    // release kfifo
-    kfifo_free(&mybuf);
-    printk(KERN_INFO "%s: kfifo_free() released kfifo.\n", THIS_MODULE->name);
-
-    // remove cdev object from kernel
-    cdev_del(&pchar_cdev);
-    printk(KERN_INFO "%s: cdev_del() removed device from kernel.\n", THIS_MODULE->name);
-
-    // destroy device file
-    device_destroy(pclass, devno);
-    printk(KERN_INFO "%s: device_destroy() destroyed pchar device.\n", THIS_MODULE->name);
-
-    // destroy device class
-    class_destroy(pclass);
-    printk(KERN_INFO "%s: class_destroy() destroyed pchar_class.\n", THIS_MODULE->name);
-
-    // release device number
-    unregister_chrdev_region(devno, 1);
-    printk(KERN_INFO "%s: unregister_chrdev_region() released device num: %d.\n", THIS_MODULE->name, major);
+    // later fifo_size writes only record the value
+    mutex_lock(&fifo_lock);
+    fifo_dev = NULL;
+    mutex_unlock(&fifo_lock);
+    pchar_core_unregister(pchar_core);
+    printk(KERN_INFO "%s: pchar_exit() completed.\n", THIS_MODULE->name);
 }
 
 module_init(pchar_init);
@@ -0,0 +1,9 @@
+#ifndef __PCHAR_IOCTL_H
+#define __PCHAR_IOCTL_H
+
+#include <linux/ioctl.h>
+// FIFO_CLEAR, FIFO_GETINFO, PCHAR_SET_EVENTFD and FIFREEZE come from pchar_core;
+// FIFREEZE is checked against uid_quota here first
+#include "pchar_core_ioctl.h"
+
+#endif
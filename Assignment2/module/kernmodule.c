@@ -1,27 +1,319 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/moduleloader.h>
-#include <linux/kmod.h>
-#include <linux/utsname.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/poll.h>
+#include <linux/timekeeping.h>
 
+// cached entry per loaded module
+typedef struct modinv {
+    struct list_head list;
+    struct module *mod;
+    char name[MODULE_NAME_LEN];
+    unsigned int size;
+    enum module_state state;
+    time64_t load_time;     // 0 if loaded before us
+}modinv_t;
 
-static int __init list_modules_init(void)
+// per open file: inventory generation last read
+typedef struct modinv_reader {
+    u64 seen;
+}modinv_reader_t;
+
+static LIST_HEAD(modinv_list);
+static DEFINE_MUTEX(modinv_lock);
+static u64 modinv_gen;
+static DECLARE_WAIT_QUEUE_HEAD(modinv_wq);
+
+static dev_t devno;
+static int major;
+static struct class *pclass;
+static struct cdev modinv_cdev;
+
+static unsigned int modinv_size(struct module *mod)
 {
+    // core sections only, like lsmod
+    return mod->mem[MOD_TEXT].size + mod->mem[MOD_DATA].size +
+           mod->mem[MOD_RODATA].size + mod->mem[MOD_RO_AFTER_INIT].size;
+}
+
+static modinv_t *modinv_find(struct module *mod)
+{
+    modinv_t *mi;
+    list_for_each_entry(mi, &modinv_list, list) {
+        if(mi->mod == mod)
+            return mi;
+    }
+    return NULL;
+}
+
+// called with modinv_lock held
+static void modinv_add(struct module *mod, time64_t load_time, gfp_t gfp)
+{
+    modinv_t *mi;
+
+    if(modinv_find(mod))
+        return;
+    mi = kzalloc(sizeof(modinv_t), gfp);
+    if(!mi) {
+        pr_err("%s: no memory to track module %s.\n", THIS_MODULE->name, mod->name);
+        return;
+    }
+    mi->mod = mod;
+    strscpy(mi->name, mod->name, MODULE_NAME_LEN);
+    mi->size = modinv_size(mod);
+    mi->state = mod->state;
+    mi->load_time = load_time;
+    list_add_tail(&mi->list, &modinv_list);
+}
+
+static void modinv_changed(void)
+{
+    modinv_gen++;
+    wake_up_interruptible(&modinv_wq);
+}
+
+static int modinv_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+    struct module *mod = data;
+    modinv_t *mi;
+
+    mutex_lock(&modinv_lock);
+    switch(action) {
+    case MODULE_STATE_COMING:
+        modinv_add(mod, ktime_get_real_seconds(), GFP_KERNEL);
+        break;
+    case MODULE_STATE_LIVE:
+        mi = modinv_find(mod);
+        if(mi)
+            mi->state = MODULE_STATE_LIVE;
+        break;
+    case MODULE_STATE_GOING:
+        // drop it before the module memory is released
+        mi = modinv_find(mod);
+        if(mi) {
+            list_del(&mi->list);
+            kfree(mi);
+        }
+        break;
+    default:
+        mutex_unlock(&modinv_lock);
+        return NOTIFY_DONE;
+    }
+    modinv_changed();
+    mutex_unlock(&modinv_lock);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block modinv_nb = {
+    .notifier_call = modinv_notify,
+};
+
+// seed the cache with modules loaded before us
+static void modinv_scan(void)
+{
+    struct list_head *pos;
     struct module *mod;
-    
-    printk(KERN_INFO "Listing all currently loaded kernel modules:\n");
-    
-    for_each_module(mod) {
-        printk(KERN_INFO "Module: %s, Size: %lu bytes\n", mod->name, mod->core_size);
+
+    mutex_lock(&modinv_lock);
+    // the module list is RCU protected; __module_address() also wants
+    // preemption off on older kernels
+    rcu_read_lock();
+    preempt_disable();
+    // walk the global module list through our own entry; the list head
+    // itself is the one node not inside a module
+    list_for_each_rcu(pos, &THIS_MODULE->list) {
+        mod = __module_address((unsigned long)pos);
+        if(!mod || &mod->list != pos)
+            continue;
+        if(mod->state == MODULE_STATE_UNFORMED || mod->state == MODULE_STATE_GOING)
+            continue;
+        modinv_add(mod, 0, GFP_ATOMIC);
+    }
+    modinv_add(THIS_MODULE, ktime_get_real_seconds(), GFP_ATOMIC);
+    preempt_enable();
+    rcu_read_unlock();
+    modinv_changed();
+    mutex_unlock(&modinv_lock);
+}
+
+static void modinv_free_all(void)
+{
+    modinv_t *mi, *tmp;
+
+    list_for_each_entry_safe(mi, tmp, &modinv_list, list) {
+        list_del(&mi->list);
+        kfree(mi);
+    }
+}
+
+static const char *modinv_state_name(enum module_state state)
+{
+    switch(state) {
+    case MODULE_STATE_LIVE:
+        return "Live";
+    case MODULE_STATE_COMING:
+        return "Loading";
+    case MODULE_STATE_GOING:
+        return "Unloading";
+    default:
+        return "Unformed";
     }
+}
+
+// seq_file interface: a header line, then one line per module
+static void *modinv_seq_start(struct seq_file *m, loff_t *pos)
+{
+    modinv_reader_t *rd = m->private;
 
+    mutex_lock(&modinv_lock);
+    if(*pos == 0) {
+        rd->seen = modinv_gen;
+        return SEQ_START_TOKEN;
+    }
+    return seq_list_start(&modinv_list, *pos - 1);
+}
+
+static void *modinv_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    // the list head's next is the first module
+    return seq_list_next(v == SEQ_START_TOKEN ? &modinv_list : v, &modinv_list, pos);
+}
+
+static void modinv_seq_stop(struct seq_file *m, void *v)
+{
+    mutex_unlock(&modinv_lock);
+}
+
+static int modinv_seq_show(struct seq_file *m, void *v)
+{
+    modinv_t *mi;
+
+    if(v == SEQ_START_TOKEN) {
+        seq_printf(m, "%-24s %8s %6s %-9s %8s %s\n", "Module", "Size", "Used", "State", "Taints", "Loaded");
+        return 0;
+    }
+    mi = list_entry(v, modinv_t, list);
+
+    // refcount and taints change without notification, read them live
+    seq_printf(m, "%-24s %8u %6d %-9s %8lx %lld\n", mi->name, mi->size,
+               module_refcount(mi->mod), modinv_state_name(mi->state),
+               READ_ONCE(mi->mod->taints), (long long)mi->load_time);
+    return 0;
+}
+
+static const struct seq_operations modinv_seq_ops = {
+    .start = modinv_seq_start,
+    .next = modinv_seq_next,
+    .stop = modinv_seq_stop,
+    .show = modinv_seq_show,
+};
+
+// device operations
+static int modinv_open(struct inode *pinode, struct file *pfile)
+{
+    modinv_reader_t *rd;
+
+    rd = __seq_open_private(pfile, &modinv_seq_ops, sizeof(modinv_reader_t));
+    if(!rd)
+        return -ENOMEM;
+    return 0;
+}
+
+// readable at any time; EPOLLPRI once the table changed since the last
+// read from offset 0
+static __poll_t modinv_poll(struct file *pfile, poll_table *wait)
+{
+    struct seq_file *m = pfile->private_data;
+    modinv_reader_t *rd = m->private;
+    __poll_t mask = EPOLLIN | EPOLLRDNORM;
+
+    poll_wait(pfile, &modinv_wq, wait);
+    if(READ_ONCE(rd->seen) != READ_ONCE(modinv_gen))
+        mask |= EPOLLPRI;
+    return mask;
+}
+
+static struct file_operations modinv_fops = {
+    .owner = THIS_MODULE,
+    .open = modinv_open,
+    .release = seq_release_private,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .poll = modinv_poll
+};
+
+static int __init list_modules_init(void)
+{
+    int ret;
+    struct device *pdevice;
+
+    pr_info("%s: list_modules_init() called.\n", THIS_MODULE->name);
+
+    // register first so nothing loaded during the scan is missed
+    ret = register_module_notifier(&modinv_nb);
+    if(ret != 0) {
+        pr_err("%s: register_module_notifier() failed.\n", THIS_MODULE->name);
+        return ret;
+    }
+    modinv_scan();
+
+    ret = alloc_chrdev_region(&devno, 0, 1, "modinv");
+    if(ret != 0) {
+        pr_err("%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
+        goto alloc_chrdev_region_failed;
+    }
+    major = MAJOR(devno);
+
+    pclass = class_create("modinv_class");
+    if(IS_ERR(pclass)) {
+        pr_err("%s: class_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pclass);
+        goto class_create_failed;
+    }
+
+    pdevice = device_create(pclass, NULL, devno, NULL, "modinv");
+    if(IS_ERR(pdevice)) {
+        pr_err("%s: device_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pdevice);
+        goto device_create_failed;
+    }
+
+    modinv_cdev.owner = THIS_MODULE;
+    cdev_init(&modinv_cdev, &modinv_fops);
+    ret = cdev_add(&modinv_cdev, devno, 1);
+    if(ret != 0) {
+        pr_err("%s: cdev_add() failed.\n", THIS_MODULE->name);
+        goto cdev_add_failed;
+    }
     return 0;
+
+cdev_add_failed:
+    device_destroy(pclass, devno);
+device_create_failed:
+    class_destroy(pclass);
+class_create_failed:
+    unregister_chrdev_region(devno, 1);
+alloc_chrdev_region_failed:
+    unregister_module_notifier(&modinv_nb);
+    modinv_free_all();
+    return ret;
 }
 
 static void __exit list_modules_exit(void)
 {
-    printk(KERN_INFO "Exiting list modules kernel module.\n");
+    pr_info("%s: list_modules_exit() called.\n", THIS_MODULE->name);
+    cdev_del(&modinv_cdev);
+    device_destroy(pclass, devno);
+    class_destroy(pclass);
+    unregister_chrdev_region(devno, 1);
+    unregister_module_notifier(&modinv_nb);
+    modinv_free_all();
 }
 
 module_init(list_modules_init);
@@ -29,5 +321,4 @@ module_exit(list_modules_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("chetna sahu <chetna7726@gmail.com>");
-MODULE_DESCRIPTION("A simple kernel module to display all loaded kernel modules.");
-
+MODULE_DESCRIPTION("Event-maintained inventory of loaded kernel modules served via /dev/modinv.");
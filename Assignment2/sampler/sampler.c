@@ -0,0 +1,238 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/sched/mm.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include "sampler.h"
+
+// sampling interval, may be changed at runtime
+static int interval_ms = 1000;
+module_param(interval_ms, int, 0644);
+// ring capacity in records, rounded up to power of 2
+static unsigned int nr_slots = 16384;
+module_param(nr_slots, uint, 0444);
+
+static void *ring;              // vmalloc_user() area: header + slots
+static size_t ring_size;
+static psample_hdr_t *hdr;
+static psample_rec_t *slots;
+
+static struct delayed_work sample_work;
+
+// device number
+static dev_t devno;
+static int major;
+// device class
+static struct class *pclass;
+// device struct - cdev
+static struct cdev psample_cdev;
+
+static void psample_fill(psample_rec_t *rec, struct task_struct *p)
+{
+    struct signal_struct *sig = p->signal;
+    struct task_struct *t;
+    struct mm_struct *mm;
+    u64 utime, stime;
+    unsigned int seq;
+
+    // cpu time of live threads plus what exited threads left in signal;
+    // an exiting thread moves its times into sig under stats_lock, so retry
+    // instead of counting it twice, as thread_group_cputime() does
+    do {
+        seq = read_seqbegin(&sig->stats_lock);
+        utime = sig->utime;
+        stime = sig->stime;
+        for_each_thread(p, t) {
+            utime += READ_ONCE(t->utime);
+            stime += READ_ONCE(t->stime);
+        }
+    } while (read_seqretry(&sig->stats_lock, seq));
+    rec->utime_ns = utime;
+    rec->stime_ns = stime;
+
+    rec->rss_pages = 0;
+    rec->vm_pages = 0;
+    task_lock(p);
+    mm = p->mm;
+    if(mm) {
+        rec->rss_pages = get_mm_rss(mm);
+        rec->vm_pages = READ_ONCE(mm->total_vm);
+    }
+    task_unlock(p);
+
+    rec->pid = p->pid;
+    rec->ppid = task_tgid_nr(rcu_dereference(p->real_parent));
+    rec->state = task_state_index(p);
+    rec->nr_threads = get_nr_threads(p);
+    memcpy(rec->comm, p->comm, PSAMPLE_COMM_LEN);
+}
+
+static void psample_round(struct work_struct *work)
+{
+    struct task_struct *p;
+    psample_rec_t *rec;
+    u64 n, round, now;
+    int ms;
+
+    n = hdr->head;
+    round = hdr->round + 1;
+    now = ktime_get_ns();
+
+    rcu_read_lock();
+    for_each_process(p) {
+        n++;
+        rec = &slots[(n - 1) & (nr_slots - 1)];
+        // invalidate slot first so lapped readers notice
+        WRITE_ONCE(rec->seq, 0);
+        smp_wmb();
+        rec->round = round;
+        rec->time_ns = now;
+        psample_fill(rec, p);
+        smp_store_release(&rec->seq, n);
+        smp_store_release(&hdr->head, n);
+    }
+    rcu_read_unlock();
+    smp_store_release(&hdr->round, round);
+
+    ms = READ_ONCE(interval_ms);
+    if(ms < 10)
+        ms = 10;
+    WRITE_ONCE(hdr->interval_ms, ms);
+    schedule_delayed_work(&sample_work, msecs_to_jiffies(ms));
+}
+
+// device operations
+static int psample_open(struct inode *pinode, struct file *pfile)
+{
+    if(pfile->f_mode & FMODE_WRITE)
+        return -EPERM;
+    pr_info("%s: psample_open() called.\n", THIS_MODULE->name);
+    return 0;
+}
+
+static int psample_close(struct inode *pinode, struct file *pfile)
+{
+    pr_info("%s: psample_close() called.\n", THIS_MODULE->name);
+    return 0;
+}
+
+static int psample_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+    // ring is read-only for user space
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vm_flags_clear(vma, VM_MAYWRITE);
+    return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+static struct file_operations psample_fops = {
+    .owner = THIS_MODULE,
+    .open = psample_open,
+    .release = psample_close,
+    .mmap = psample_mmap
+};
+
+static int __init psample_init(void)
+{
+    int ret;
+    struct device *pdevice;
+    size_t data_offset;
+
+    pr_info("%s: psample_init() called.\n", THIS_MODULE->name);
+
+    if(nr_slots < 64)
+        nr_slots = 64;
+    nr_slots = roundup_pow_of_two(nr_slots);
+    data_offset = ALIGN(sizeof(psample_hdr_t), 64);
+    ring_size = PAGE_ALIGN(data_offset + (size_t)nr_slots * sizeof(psample_rec_t));
+
+    // zeroed and safe to map into user space
+    ring = vmalloc_user(ring_size);
+    if(!ring) {
+        pr_err("%s: vmalloc_user() failed.\n", THIS_MODULE->name);
+        return -ENOMEM;
+    }
+    hdr = ring;
+    slots = ring + data_offset;
+    hdr->magic = PSAMPLE_MAGIC;
+    hdr->version = PSAMPLE_VERSION;
+    hdr->nr_slots = nr_slots;
+    hdr->rec_size = sizeof(psample_rec_t);
+    hdr->data_offset = data_offset;
+    hdr->interval_ms = interval_ms;
+    pr_info("%s: ring of %u records (%zu bytes) allocated.\n", THIS_MODULE->name, nr_slots, ring_size);
+
+    ret = alloc_chrdev_region(&devno, 0, 1, "psample");
+    if(ret != 0) {
+        pr_err("%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
+        goto alloc_chrdev_region_failed;
+    }
+    major = MAJOR(devno);
+
+    pclass = class_create("psample_class");
+    if(IS_ERR(pclass)) {
+        pr_err("%s: class_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pclass);
+        goto class_create_failed;
+    }
+
+    pdevice = device_create(pclass, NULL, devno, NULL, "psample");
+    if(IS_ERR(pdevice)) {
+        pr_err("%s: device_create() failed.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pdevice);
+        goto device_create_failed;
+    }
+
+    psample_cdev.owner = THIS_MODULE;
+    cdev_init(&psample_cdev, &psample_fops);
+    ret = cdev_add(&psample_cdev, devno, 1);
+    if(ret != 0) {
+        pr_err("%s: cdev_add() failed.\n", THIS_MODULE->name);
+        goto cdev_add_failed;
+    }
+
+    // take first sample right away
+    INIT_DELAYED_WORK(&sample_work, psample_round);
+    schedule_delayed_work(&sample_work, 0);
+    pr_info("%s: sampling every %d ms into /dev/psample.\n", THIS_MODULE->name, interval_ms);
+    return 0;
+
+cdev_add_failed:
+    device_destroy(pclass, devno);
+device_create_failed:
+    class_destroy(pclass);
+class_create_failed:
+    unregister_chrdev_region(devno, 1);
+alloc_chrdev_region_failed:
+    vfree(ring);
+    return ret;
+}
+
+static void __exit psample_exit(void)
+{
+    pr_info("%s: psample_exit() called.\n", THIS_MODULE->name);
+    cancel_delayed_work_sync(&sample_work);
+    cdev_del(&psample_cdev);
+    device_destroy(pclass, devno);
+    class_destroy(pclass);
+    unregister_chrdev_region(devno, 1);
+    // existing mappings hold their own page references
+    vfree(ring);
+}
+
+module_init(psample_init);
+module_exit(psample_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("chetna sahu <chetna7726@gmail.com>");
+MODULE_DESCRIPTION("Periodic per-process cpu/memory sampler exported as an mmap-able binary ring");
@@ -0,0 +1,50 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#include <linux/types.h>
+
+// shared between sampler.ko and user space readers of /dev/psample
+
+#define PSAMPLE_MAGIC   0x504d5350  // "PSMP"
+#define PSAMPLE_VERSION 1
+#define PSAMPLE_COMM_LEN 16
+
+// ring header at offset 0 of the mapping
+typedef struct psample_hdr {
+    __u32 magic;
+    __u32 version;
+    __u32 nr_slots;     // records in ring, power of 2
+    __u32 rec_size;     // sizeof(psample_rec_t)
+    __u32 data_offset;  // offset of slot 0 from start of mapping
+    __u32 interval_ms;  // current sampling interval
+    __u64 head;         // records written so far, slot = (head - 1) & (nr_slots - 1)
+    __u64 round;        // sampling rounds completed
+} psample_hdr_t;
+
+// one record per process per round
+typedef struct psample_rec {
+    __u64 seq;          // record number + 1, 0 while the slot is being rewritten
+    __u64 round;        // round this record belongs to
+    __u64 time_ns;      // ktime_get_ns() at start of the round
+    __u64 utime_ns;     // user cpu time of the whole thread group
+    __u64 stime_ns;     // system cpu time of the whole thread group
+    __u64 rss_pages;
+    __u64 vm_pages;
+    __s32 pid;
+    __s32 ppid;
+    __u32 state;        // task_state_index(), same order as "RSDTtXZPI"
+    __u32 nr_threads;
+    char comm[PSAMPLE_COMM_LEN];
+} psample_rec_t;
+
+/*
+ * Reading without syscalls: load hdr->head (acquire), copy slot
+ * (n - 1) & (nr_slots - 1) for each wanted n, issue a read barrier
+ * (smp_rmb(), or __atomic_thread_fence(__ATOMIC_ACQUIRE) in user space)
+ * so the copy completes before seq is loaded again, then check that the
+ * slot's seq still equals n. An acquire load of seq alone does not order
+ * the earlier data loads before it. A different seq means the writer
+ * lapped the reader and the copy must be dropped.
+ */
+
+#endif
@@ -6,89 +6,728 @@
 #include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/lz4.h>
+#include <linux/crc32c.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/completion.h>
+#include <linux/refcount.h>
+#include "pchar_core.h"
+#include "pchar_ioctl.h"
+
+// record header stored in the ring in front of every payload
+typedef struct prec
+{
+    u64 seq;
+    u64 ts;         // ktime_get_ns() when queued
+    u32 len;        // payload bytes in the ring
+    u32 orig_len;   // bytes returned to the reader
+    u32 flags;
+    u32 crc;        // crc32c of the orig_len bytes returned to the reader
+}prec_t;
+#define PREC_LZ4 0x01   // payload is LZ4 compressed
+#define PREC_CRC 0x02   // crc is valid
+#define PREC_ZC  0x04   // payload is a pchar_zc_t pointer, data is in the writer's pages
+
+// A large write pins the writer's pages and queues only a reference; the
+// reader copies straight out of them and the writer sleeps until it has.
+// Whoever drops the last reference frees it, the writer may get killed.
+typedef struct pchar_zc
+{
+    struct page **pages;
+    unsigned int npages;
+    unsigned int offset;    // of the data in pages[0]
+    size_t len;
+    struct completion done;
+    refcount_t ref;         // writer + queue
+}pchar_zc_t;
+#define PCHAR_ZC_MAX (64 << 20)
+
+// one ring per priority; writers only serialize with writers of the same
+// priority, so a control record never waits behind a stalled bulk writer
+typedef struct pchar_ring
+{
+    struct kfifo fifo;
+    void *fifo_mem;     // ring storage, from the caches fifo pools
+    struct mutex wr_lock;
+    char *wstage;       // prec_t + plain record being written
+    char *zbuf;         // prec_t + compressed record, allocated on first LZ4 use
+    pchar_stats_t stats;    // write side under wr_lock
+    atomic64_t crc_checked;
+    atomic64_t crc_errors;
+}pchar_ring_t;
 
 // private device structs
-typedef struct pchardev 
+typedef struct pchardev
 {
-    struct kfifo mybuf;
+    pchar_ring_t ring[PCHAR_PRIO_MAX];  // ring[0] is drained first
     dev_t devno;
     struct cdev cdev;
     int id;
     wait_queue_head_t rd_wq;
+    wait_queue_head_t wr_wq;
+    // kfifo is safe with one reader and one writer, so readers serialize on
+    // rd_lock and writers on the wr_lock of their ring
+    struct mutex rd_lock;
+    struct mutex lz4_lock;  // lz4_wrk and LZ4 buffer setup
+    int xform;          // PCHAR_XFORM_*, set under lz4_lock
+    bool crc;           // stamp new records with crc32c
+    char *rstage;       // prec_t + stored record being read
+    char *rplain;       // decompressed record
+    void *lz4_wrk;
+    atomic64_t seq;
+    bool tstamp;        // reads return pchar_rec_hdr_t
+    u64 hist[PCHAR_HIST_BUCKETS];   // residency, under rd_lock
 }pchardev_t;
 
-#define MAX 32
+// per open file state
+typedef struct pcharfile
+{
+    pchardev_t *dev;
+    int prio;           // ring for writes, or PCHAR_PRIO_INLINE
+}pcharfile_t;
+
+#define FIFO_SIZE_MIN 64
+#define FIFO_SIZE_MAX (1024 * 1024)
 // device count & device data
 static int DEVCNT = 4;
 module_param_named(devcnt, DEVCNT, int, 0444);
-static pchardev_t *devices;
+// FIFO buffers kept in reserve, recycled when a device goes away
+static int POOLCNT = 4;
+module_param_named(poolcnt, POOLCNT, int, 0444);
+// ring bytes per device, rounded up to a power of 2; a record must fit whole
+static int FIFOSIZE = 4096;
+module_param_named(fifo_size, FIFOSIZE, int, 0444);
+// rings per device, 1..PCHAR_PRIO_MAX; each is fifo_size bytes
+static int NPRIO = 1;
+module_param_named(nprio, NPRIO, int, 0444);
+// blocking writes of at least this many bytes pass pinned pages instead of
+// being copied into the ring, 0 = off; such records skip LZ4 and crc
+static int ZC_MIN = 64 * 1024;
+module_param_named(zerocopy_min, ZC_MIN, int, 0644);
+// initial transform of every device: 1 = LZ4
+static int XFORM = PCHAR_XFORM_NONE;
+module_param_named(xform, XFORM, int, 0444);
+// initial integrity mode of every device
+static bool CRC;
+module_param_named(crc, CRC, bool, 0444);
+static pchardev_t **devices;
+// dedicated caches so device churn stays off the general kmalloc slabs
+static pchar_core_caches_t caches;
+
+// largest record a write can carry
+static unsigned int pchar_max_record(pchardev_t *dev)
+{
+    return kfifo_size(&dev->ring[0].fifo) - sizeof(prec_t);
+}
+
+static int pchar_alloc_bufs(pchardev_t *dev)
+{
+    size_t len = sizeof(prec_t) + FIFOSIZE;
+    pchar_ring_t *ring;
+    int p;
+
+    dev->rstage = kvmalloc(len, GFP_KERNEL_ACCOUNT);
+    if(!dev->rstage)
+        return -ENOMEM;
+    for(p = 0; p < NPRIO; p++)
+    {
+        ring = &dev->ring[p];
+        ring->fifo_mem = pchar_core_fifo_alloc(&caches, NUMA_NO_NODE, GFP_KERNEL_ACCOUNT);
+        ring->wstage = kvmalloc(len, GFP_KERNEL_ACCOUNT);
+        if(!ring->fifo_mem || !ring->wstage)
+            return -ENOMEM;
+        kfifo_init(&ring->fifo, ring->fifo_mem, FIFOSIZE);
+    }
+    return 0;
+}
+
+// LZ4 state, kept once allocated since stored records may still need it;
+// lz4_lock held
+static int pchar_alloc_lz4(pchardev_t *dev)
+{
+    bool ok;
+    int p;
+
+    if(dev->lz4_wrk)
+        return 0;
+    dev->rplain = kvmalloc(FIFOSIZE, GFP_KERNEL_ACCOUNT);
+    ok = dev->rplain != NULL;
+    for(p = 0; p < NPRIO; p++)
+    {
+        dev->ring[p].zbuf = kvmalloc(sizeof(prec_t) + LZ4_compressBound(FIFOSIZE), GFP_KERNEL_ACCOUNT);
+        ok = ok && dev->ring[p].zbuf;
+    }
+    dev->lz4_wrk = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL_ACCOUNT);
+    if(!ok || !dev->lz4_wrk)
+    {
+        kvfree(dev->rplain);
+        kvfree(dev->lz4_wrk);
+        dev->rplain = dev->lz4_wrk = NULL;
+        for(p = 0; p < NPRIO; p++)
+        {
+            kvfree(dev->ring[p].zbuf);
+            dev->ring[p].zbuf = NULL;
+        }
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void pchar_zc_put(pchar_zc_t *zc)
+{
+    if(!refcount_dec_and_test(&zc->ref))
+        return;
+    kvfree(zc->pages);
+    kfree(zc);
+}
+
+// queue side is done with the pages, release the writer
+static void pchar_zc_finish(pchar_zc_t *zc)
+{
+    unpin_user_pages(zc->pages, zc->npages);
+    complete(&zc->done);
+    pchar_zc_put(zc);
+}
+
+static int pchar_zc_copy(pchar_zc_t *zc, struct iov_iter *to)
+{
+    size_t off = zc->offset, left = zc->len, n;
+    unsigned int i;
+
+    for(i = 0; i < zc->npages && left; i++)
+    {
+        n = min_t(size_t, PAGE_SIZE - off, left);
+        if(copy_page_to_iter(zc->pages[i], off, n, to) != n)
+            return -EFAULT;
+        left -= n;
+        off = 0;
+    }
+    return 0;
+}
+
+// drop every queued record, releasing pinned writers; rd_lock held or
+// the device no longer reachable
+static void pchar_ring_drain(pchardev_t *dev, pchar_ring_t *ring)
+{
+    prec_t hdr;
+    pchar_zc_t *zc;
+
+    while(kfifo_out(&ring->fifo, &hdr, sizeof(hdr)) == sizeof(hdr))
+    {
+        if(hdr.flags & PREC_ZC)
+        {
+            kfifo_out(&ring->fifo, &zc, sizeof(zc));
+            pchar_zc_finish(zc);
+        }
+        else
+            kfifo_out(&ring->fifo, dev->rstage, hdr.len);
+    }
+}
+
+// NULL safe, devices are zero allocated
+static void pchar_free_bufs(pchardev_t *dev)
+{
+    int p;
+
+    for(p = 0; p < PCHAR_PRIO_MAX; p++)
+    {
+        pchar_ring_drain(dev, &dev->ring[p]);
+        pchar_core_fifo_free(&caches, dev->ring[p].fifo_mem);
+        kvfree(dev->ring[p].wstage);
+        kvfree(dev->ring[p].zbuf);
+    }
+    kvfree(dev->rstage);
+    kvfree(dev->rplain);
+    kvfree(dev->lz4_wrk);
+}
+
+// writers pick up xform through lz4_lock, so they never see LZ4 before its
+// buffers; a reader sees an LZ4 record only after the kfifo barriers
+static int pchar_set_xform(pchardev_t *dev, int xform)
+{
+    int ret = 0;
+
+    if(xform != PCHAR_XFORM_NONE && xform != PCHAR_XFORM_LZ4)
+        return -EINVAL;
+    if(mutex_lock_interruptible(&dev->lz4_lock))
+        return -ERESTARTSYS;
+    if(xform == PCHAR_XFORM_LZ4)
+        ret = pchar_alloc_lz4(dev);
+    if(ret == 0)
+        WRITE_ONCE(dev->xform, xform);
+    mutex_unlock(&dev->lz4_lock);
+    return ret;
+}
+
+// highest priority ring holding a record, NULL if all are empty
+static pchar_ring_t *pchar_next_ring(pchardev_t *dev)
+{
+    int p;
+
+    for(p = 0; p < NPRIO; p++)
+    {
+        if(!kfifo_is_empty(&dev->ring[p].fifo))
+            return &dev->ring[p];
+    }
+    return NULL;
+}
 
 // device operations
-static int pchar_open(struct inode *pinode, struct file *pfile) 
+static int pchar_open(struct inode *pinode, struct file *pfile)
 {
     pchardev_t *dev = container_of(pinode->i_cdev, pchardev_t, cdev);
-    pfile->private_data = dev;
+    pcharfile_t *pf;
+
+    pf = kmalloc(sizeof(*pf), GFP_KERNEL_ACCOUNT);
+    if(!pf)
+        return -ENOMEM;
+    // until PCHAR_SET_PRIO, writes are bulk traffic
+    pf->dev = dev;
+    pf->prio = NPRIO - 1;
+    pfile->private_data = pf;
+    // read_iter/write_iter honour IOCB_NOWAIT, io_uring may try them inline
+    pfile->f_mode |= FMODE_NOWAIT;
     pr_info("%s: pchar_open() called for pchar%d.\n", THIS_MODULE->name, dev->id);
     return 0;
 }
 
-static int pchar_close(struct inode *pinode, struct file *pfile) 
+static int pchar_close(struct inode *pinode, struct file *pfile)
 {
-    pchardev_t *dev = (pchardev_t *)pfile->private_data;
-    pr_info("%s: pchar_close() called for pchar%d.\n", THIS_MODULE->name, dev->id);
+    pcharfile_t *pf = (pcharfile_t *)pfile->private_data;
+    pr_info("%s: pchar_close() called for pchar%d.\n", THIS_MODULE->name, pf->dev->id);
+    kfree(pf);
     return 0;
 }
 
-static ssize_t pchar_write(struct file *pfile, const char * __user ubuf, size_t bufsize, loff_t *pf_pos) 
+// O_NONBLOCK and io_uring's inline IOCB_NOWAIT attempt both get -EAGAIN
+// instead of sleeping, on the lock as well as on ring space
+static bool pchar_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static int pchar_lock(struct mutex *lock, struct kiocb *iocb)
+{
+    if(iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+// Queue a reference to the writer's pinned pages and wait for a reader to
+// copy them out. Only used for a single user buffer in blocking mode.
+static ssize_t pchar_write_zc(pchardev_t *dev, pchar_ring_t *ring, struct iov_iter *from)
 {
-    pchardev_t *dev = (pchardev_t *)pfile->private_data;
-    int ret, nbytes;
-    pr_info("%s: pchar_write() called for pchar%d.\n", THIS_MODULE->name, dev->id);
-    ret = kfifo_to_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if(ret < 0) 
+    size_t len = iov_iter_count(from);
+    unsigned long start = (unsigned long)iter_iov_addr(from);
+    char *rec = ring->wstage;
+    prec_t *hdr = (prec_t *)rec;
+    unsigned int need = sizeof(prec_t) + sizeof(pchar_zc_t *);
+    pchar_zc_t *zc;
+    int ret;
+
+    zc = kzalloc(sizeof(*zc), GFP_KERNEL_ACCOUNT);
+    if(!zc)
+        return -ENOMEM;
+    zc->offset = offset_in_page(start);
+    zc->len = len;
+    zc->npages = DIV_ROUND_UP(zc->offset + len, PAGE_SIZE);
+    init_completion(&zc->done);
+    refcount_set(&zc->ref, 2);
+    zc->pages = kvmalloc_array(zc->npages, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+    if(!zc->pages)
     {
-        pr_err("%s: kfifo_to_user() failed for pchar%d.\n", THIS_MODULE->name, dev->id);
-        return ret;
+        kfree(zc);
+        return -ENOMEM;
     }
-    pr_info("%s: pchar_write() written %d bytes in pchar%d.\n", THIS_MODULE->name, nbytes, dev->id);
-    if(nbytes > 0) 
+    // the reader only reads them, no FOLL_WRITE; held until some reader
+    // drains the record, so pin long term, out of CMA/movable zones
+    ret = pin_user_pages_fast(start & PAGE_MASK, zc->npages, FOLL_LONGTERM, zc->pages);
+    if(ret != zc->npages)
     {
-        wake_up_interruptible(&dev->rd_wq);
-        pr_info("%s: pchar_write() wokeup a process blocked for pchar%d.\n", THIS_MODULE->name, dev->id);
+        if(ret > 0)
+            unpin_user_pages(zc->pages, ret);
+        kvfree(zc->pages);
+        kfree(zc);
+        return ret < 0 ? ret : -EFAULT;
+    }
+
+    if(mutex_lock_interruptible(&ring->wr_lock))
+    {
+        ret = -ERESTARTSYS;
+        goto unpin;
+    }
+    while(kfifo_avail(&ring->fifo) < need)
+    {
+        ret = wait_event_interruptible(dev->wr_wq, kfifo_avail(&ring->fifo) >= need);
+        if(ret != 0)
+        {
+            mutex_unlock(&ring->wr_lock);
+            goto unpin;
+        }
     }
+    hdr->len = sizeof(zc);
+    hdr->orig_len = len;
+    hdr->flags = PREC_ZC;
+    hdr->crc = 0;
+    hdr->seq = atomic64_inc_return(&dev->seq) - 1;
+    hdr->ts = ktime_get_ns();
+    memcpy(rec + sizeof(prec_t), &zc, sizeof(zc));
+    kfifo_in(&ring->fifo, rec, need);
+    ring->stats.records++;
+    ring->stats.zc_records++;
+    ring->stats.bytes_in += len;
+    ring->stats.bytes_stored += hdr->len;
+    mutex_unlock(&ring->wr_lock);
+    wake_up_interruptible(&dev->rd_wq);
+
+    // the queue owns the pages now; only a fatal signal stops the wait
+    ret = wait_for_completion_killable(&zc->done);
+    pchar_zc_put(zc);
+    if(ret != 0)
+        return ret;
+    iov_iter_advance(from, len);
+    return len;
 
-    return nbytes;
+unpin:
+    unpin_user_pages(zc->pages, zc->npages);
+    kvfree(zc->pages);
+    kfree(zc);
+    return ret;
 }
 
-static ssize_t pchar_read(struct file *pfile, char * __user ubuf, size_t bufsize, loff_t *pf_pos) 
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    pchardev_t *dev = (pchardev_t *)pfile->private_data;
-    int ret, nbytes;
-    pr_info("%s: pchar_read() called for pchar%d.\n", THIS_MODULE->name, dev->id);
+    pcharfile_t *pf = (pcharfile_t *)iocb->ki_filp->private_data;
+    pchardev_t *dev = pf->dev;
+    int prio = READ_ONCE(pf->prio);
+    size_t plen = 0, bufsize;
+    pchar_prio_hdr_t ph;
+    pchar_ring_t *ring;
+    char *rec;
+    prec_t *hdr;
+    unsigned int need, flags = 0;
+    u32 crc = 0;
+    int ret, clen, zc_min;
 
-   // if mybuf is full, block the reader process
-    ret = wait_event_interruptible(dev->rd_wq, !kfifo_is_full(&dev->mybuf));
+    if(iov_iter_count(from) == 0)
+        return 0;
+    if(prio == PCHAR_PRIO_INLINE)
+    {
+        plen = sizeof(ph);
+        if(!copy_from_iter_full(&ph, plen, from))
+            return -EFAULT;
+        if(ph.prio >= NPRIO)
+            return -EINVAL;
+        prio = ph.prio;
+    }
+    bufsize = iov_iter_count(from);
+    if(bufsize == 0)
+        return plen;
+    ring = &dev->ring[prio];
+    // big blocking writes from one user buffer go by page reference
+    zc_min = READ_ONCE(ZC_MIN);
+    if(zc_min > 0 && bufsize >= zc_min && iter_is_ubuf(from) && !pchar_nowait(iocb))
+    {
+        if(bufsize > PCHAR_ZC_MAX)
+            return -EMSGSIZE;
+        ret = pchar_write_zc(dev, ring, from);
+        return ret < 0 ? ret : plen + ret;
+    }
+    if(bufsize > pchar_max_record(dev))
+        return -EMSGSIZE;
+    ret = pchar_lock(&ring->wr_lock, iocb);
     if(ret != 0)
-     {
-        pr_err("%s: pchar_read() process blocked for pchar%d wakeup due to signal.\n", THIS_MODULE->name, dev->id);
         return ret;
+    rec = ring->wstage;
+    if(!copy_from_iter_full(rec + sizeof(prec_t), bufsize, from))
+    {
+        ret = -EFAULT;
+        goto out;
     }
-    ret = kfifo_from_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if(ret < 0) 
+    // crc covers the bytes as user space sees them, so it also checks the transform
+    if(READ_ONCE(dev->crc))
+    {
+        crc = crc32c(~0, rec + sizeof(prec_t), bufsize);
+        flags |= PREC_CRC;
+    }
+    hdr = (prec_t *)rec;
+    hdr->len = bufsize;
+    // keep the compressed form only if it is actually smaller
+    if(READ_ONCE(dev->xform) == PCHAR_XFORM_LZ4)
+    {
+        ret = pchar_lock(&dev->lz4_lock, iocb);
+        if(ret != 0)
+            goto out;
+        clen = LZ4_compress_default(rec + sizeof(prec_t), ring->zbuf + sizeof(prec_t),
+                                    bufsize, bufsize - 1, dev->lz4_wrk);
+        mutex_unlock(&dev->lz4_lock);
+        if(clen > 0)
+        {
+            rec = ring->zbuf;
+            hdr = (prec_t *)rec;
+            hdr->len = clen;
+            flags |= PREC_LZ4;
+        }
+    }
+    hdr->orig_len = bufsize;
+    hdr->flags = flags;
+    hdr->crc = crc;
+
+    // header and payload go in with one kfifo_in, a reader never sees half a record
+    need = sizeof(prec_t) + hdr->len;
+    while(kfifo_avail(&ring->fifo) < need)
     {
-        pr_err("%s: kfifo_from_user() failed for pchar%d.\n", THIS_MODULE->name, dev->id);
+        if(pchar_nowait(iocb))
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+        ret = wait_event_interruptible(dev->wr_wq, kfifo_avail(&ring->fifo) >= need);
+        if(ret != 0)
+            goto out;
+    }
+    hdr->seq = atomic64_inc_return(&dev->seq) - 1;
+    hdr->ts = ktime_get_ns();
+    kfifo_in(&ring->fifo, rec, need);
+    ring->stats.records++;
+    ring->stats.bytes_in += bufsize;
+    ring->stats.bytes_stored += hdr->len;
+    ret = plen + bufsize;
+out:
+    mutex_unlock(&ring->wr_lock);
+    if(ret > 0)
+        wake_up_interruptible(&dev->rd_wq);
+    return ret;
+}
+
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    pchardev_t *dev = ((pcharfile_t *)iocb->ki_filp->private_data)->dev;
+    size_t bufsize = iov_iter_count(to);
+    prec_t *hdr = (prec_t *)dev->rstage;
+    pchar_ring_t *ring;
+    pchar_rec_hdr_t uhdr;
+    bool tstamp = READ_ONCE(dev->tstamp);
+    size_t hlen = tstamp ? sizeof(uhdr) : 0;
+    pchar_zc_t *zc = NULL;
+    u64 residency;
+    char *data;
+    int ret;
+
+    ret = pchar_lock(&dev->rd_lock, iocb);
+    if(ret != 0)
         return ret;
+    // if all rings are empty, block the reader process
+    while(!(ring = pchar_next_ring(dev)))
+    {
+        if(pchar_nowait(iocb))
+        {
+            ret = -EAGAIN;
+            goto out;
+        }
+        ret = wait_event_interruptible(dev->rd_wq, pchar_next_ring(dev) != NULL);
+        if(ret != 0)
+            goto out;
+    }
+    kfifo_out_peek(&ring->fifo, hdr, sizeof(prec_t));
+    // the record stays queued for a larger read
+    if(hlen + hdr->orig_len > bufsize)
+    {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+    kfifo_out(&ring->fifo, dev->rstage, sizeof(prec_t) + hdr->len);
+    wake_up_interruptible(&dev->wr_wq);
+    residency = ktime_get_ns() - hdr->ts;
+    dev->hist[min_t(int, ilog2(residency | 1), PCHAR_HIST_BUCKETS - 1)]++;
+
+    data = dev->rstage + sizeof(prec_t);
+    if(hdr->flags & PREC_ZC)
+        memcpy(&zc, data, sizeof(zc));
+    if(hdr->flags & PREC_LZ4)
+    {
+        ret = LZ4_decompress_safe(data, dev->rplain, hdr->len, hdr->orig_len);
+        if(ret != hdr->orig_len)
+        {
+            pr_err("%s: corrupt LZ4 record dropped on pchar%d.\n", THIS_MODULE->name, dev->id);
+            ret = -EBADMSG;
+            goto out;
+        }
+        data = dev->rplain;
+    }
+    if(hdr->flags & PREC_CRC)
+    {
+        atomic64_inc(&ring->crc_checked);
+        if(crc32c(~0, data, hdr->orig_len) != hdr->crc)
+        {
+            atomic64_inc(&ring->crc_errors);
+            pr_err_ratelimited("%s: crc mismatch, record dropped on pchar%d.\n", THIS_MODULE->name, dev->id);
+            ret = -EBADMSG;
+            goto out;
+        }
+    }
+    if(tstamp)
+    {
+        uhdr.seq = hdr->seq;
+        uhdr.ts_ns = hdr->ts;
+        uhdr.residency_ns = residency;
+        uhdr.len = hdr->orig_len;
+        uhdr.flags = hdr->flags;
+        if(copy_to_iter(&uhdr, hlen, to) != hlen)
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+    }
+    // the single copy of a pinned write: writer's pages to the reader
+    if(zc)
+        ret = pchar_zc_copy(zc, to) ? -EFAULT : hlen + hdr->orig_len;
+    else
+        ret = copy_to_iter(data, hdr->orig_len, to) != hdr->orig_len ? -EFAULT : hlen + hdr->orig_len;
+out:
+    mutex_unlock(&dev->rd_lock);
+    if(zc)
+        pchar_zc_finish(zc);
+    return ret;
+}
+
+// readable once a whole record is queued; writable once at least a one byte
+// record fits the caller's ring, a larger write may still get -EAGAIN and
+// poll again
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait)
+{
+    pcharfile_t *pf = (pcharfile_t *)pfile->private_data;
+    pchardev_t *dev = pf->dev;
+    int p, prio = READ_ONCE(pf->prio);
+    __poll_t mask = 0;
+
+    poll_wait(pfile, &dev->rd_wq, wait);
+    poll_wait(pfile, &dev->wr_wq, wait);
+    if(pchar_next_ring(dev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    for(p = 0; p < NPRIO; p++)
+    {
+        if((prio == PCHAR_PRIO_INLINE || prio == p) && kfifo_avail(&dev->ring[p].fifo) > sizeof(prec_t))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+// write side counters of one ring
+static int pchar_ring_stats(pchar_ring_t *ring, pchar_stats_t *stats)
+{
+    if(mutex_lock_interruptible(&ring->wr_lock))
+        return -ERESTARTSYS;
+    *stats = ring->stats;
+    mutex_unlock(&ring->wr_lock);
+    stats->crc_checked = atomic64_read(&ring->crc_checked);
+    stats->crc_errors = atomic64_read(&ring->crc_errors);
+    return 0;
+}
+
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    pcharfile_t *pf = (pcharfile_t *)pfile->private_data;
+    pchardev_t *dev = pf->dev;
+    pchar_prio_stats_t pstats;
+    pchar_stats_t stats, st;
+    pchar_hist_t hist;
+    devinfo_t info;
+    int i;
+
+    switch(cmd)
+    {
+    case FIFO_CLEAR:
+        // drop whole records from the reader side, writers may keep going;
+        // pinned writers are released as if their data had been read
+        if(mutex_lock_interruptible(&dev->rd_lock))
+            return -ERESTARTSYS;
+        for(i = 0; i < NPRIO; i++)
+            pchar_ring_drain(dev, &dev->ring[i]);
+        mutex_unlock(&dev->rd_lock);
+        wake_up_interruptible(&dev->wr_wq);
+        return 0;
+
+    case FIFO_GETINFO:
+        // totals over all rings
+        memset(&info, 0, sizeof(info));
+        for(i = 0; i < NPRIO; i++)
+        {
+            info.size += kfifo_size(&dev->ring[i].fifo);
+            info.len += kfifo_len(&dev->ring[i].fifo);
+            info.avail += kfifo_avail(&dev->ring[i].fifo);
+        }
+        return copy_to_user((void __user *)param, &info, sizeof(info)) ? -EFAULT : 0;
+
+    case PCHAR_SET_XFORM:
+        return pchar_set_xform(dev, (int)param);
+
+    case PCHAR_SET_CRC:
+        WRITE_ONCE(dev->crc, !!param);
+        return 0;
+
+    case PCHAR_SET_TSTAMP:
+        WRITE_ONCE(dev->tstamp, !!param);
+        return 0;
+
+    case PCHAR_SET_PRIO:
+        if((int)param != PCHAR_PRIO_INLINE && ((int)param < 0 || (int)param >= NPRIO))
+            return -EINVAL;
+        WRITE_ONCE(pf->prio, (int)param);
+        return 0;
+
+    case PCHAR_GET_HIST:
+        // buckets are copied without rd_lock, a blocked reader holds it
+        hist.seq = atomic64_read(&dev->seq);
+        for(i = 0; i < PCHAR_HIST_BUCKETS; i++)
+            hist.bucket[i] = READ_ONCE(dev->hist[i]);
+        return copy_to_user((void __user *)param, &hist, sizeof(hist)) ? -EFAULT : 0;
+
+    case PCHAR_GET_STATS:
+        memset(&stats, 0, sizeof(stats));
+        for(i = 0; i < NPRIO; i++)
+        {
+            if(pchar_ring_stats(&dev->ring[i], &st))
+                return -ERESTARTSYS;
+            stats.records += st.records;
+            stats.bytes_in += st.bytes_in;
+            stats.bytes_stored += st.bytes_stored;
+            stats.crc_checked += st.crc_checked;
+            stats.crc_errors += st.crc_errors;
+            stats.zc_records += st.zc_records;
+        }
+        return copy_to_user((void __user *)param, &stats, sizeof(stats)) ? -EFAULT : 0;
+
+    case PCHAR_GET_PRIO_STATS:
+        memset(&pstats, 0, sizeof(pstats));
+        pstats.nprio = NPRIO;
+        for(i = 0; i < NPRIO; i++)
+        {
+            if(pchar_ring_stats(&dev->ring[i], &pstats.prio[i]))
+                return -ERESTARTSYS;
+            pstats.len[i] = kfifo_len(&dev->ring[i].fifo);
+        }
+        return copy_to_user((void __user *)param, &pstats, sizeof(pstats)) ? -EFAULT : 0;
+
+    default:
+        pr_err("%s: invalid ioctl command for pchar%d.\n", THIS_MODULE->name, dev->id);
+        return -EINVAL;
     }
-    pr_info("%s: pchar_read() read %d bytes in pchar%d.\n", THIS_MODULE->name, nbytes, dev->id);
-    return nbytes;
 }
 
 static struct file_operations pchar_fops = {
-    .owner = THIS_MODULE, 
+    .owner = THIS_MODULE,
     .open = pchar_open,
     .release = pchar_close,
-    .read = pchar_read,
-    .write = pchar_write,
+    .read_iter = pchar_read_iter,
+    .write_iter = pchar_write_iter,
+    .poll = pchar_poll,
+    .unlocked_ioctl = pchar_ioctl,
 };
 
 // other global vars
@@ -98,19 +737,69 @@ static struct class *pclass;
 
 static int __init pchar_init(void)
  {
-    int ret, i;
+    int ret, i, p;
     struct device *pdevice;
     dev_t devnum;
     pr_info("%s: pchar_init() called.\n", THIS_MODULE->name);
 
-    // allocate array device private structs
-    devices = kmalloc(DEVCNT * sizeof(pchardev_t), GFP_KERNEL);
-    if(IS_ERR(devices)) 
+    if(FIFOSIZE < FIFO_SIZE_MIN || FIFOSIZE > FIFO_SIZE_MAX)
     {
-        pr_err("%s: kmalloc() failed.\n", THIS_MODULE->name);
-        ret = -1;
+        pr_err("%s: fifo_size must be %d..%d.\n", THIS_MODULE->name, FIFO_SIZE_MIN, FIFO_SIZE_MAX);
+        return -EINVAL;
+    }
+    FIFOSIZE = roundup_pow_of_two(FIFOSIZE);
+    if(NPRIO < 1 || NPRIO > PCHAR_PRIO_MAX)
+    {
+        pr_err("%s: nprio must be 1..%d.\n", THIS_MODULE->name, PCHAR_PRIO_MAX);
+        return -EINVAL;
+    }
+
+    // slab caches for device structs and FIFO buffers
+    ret = pchar_core_caches_create(&caches, KBUILD_MODNAME, sizeof(pchardev_t), FIFOSIZE, POOLCNT);
+    if(ret)
+        return ret;
+
+    // allocate device private structs
+    devices = kcalloc(DEVCNT, sizeof(pchardev_t *), GFP_KERNEL);
+    if(!devices) 
+    {
+        pr_err("%s: kcalloc() failed.\n", THIS_MODULE->name);
+        ret = -ENOMEM;
         goto kmalloc_failed;
     }
+    for(i=0; i<DEVCNT; i++)
+    {
+        devices[i] = kmem_cache_zalloc(caches.dev_cache, GFP_KERNEL);
+        if(!devices[i])
+        {
+            pr_err("%s: kmem_cache_zalloc() failed for pchar%d.\n", THIS_MODULE->name, i);
+            ret = -ENOMEM;
+            goto dev_alloc_failed;
+        }
+    }
+
+    // initialize device info and buffers before any device goes live
+    for(i=0; i<DEVCNT; i++) 
+    {
+        devices[i]->id = i;
+        init_waitqueue_head(&devices[i]->rd_wq);
+        init_waitqueue_head(&devices[i]->wr_wq);
+        for(p=0; p<PCHAR_PRIO_MAX; p++)
+            mutex_init(&devices[i]->ring[p].wr_lock);
+        mutex_init(&devices[i]->rd_lock);
+        mutex_init(&devices[i]->lz4_lock);
+        devices[i]->crc = CRC;
+        ret = pchar_alloc_bufs(devices[i]);
+        if(ret == 0)
+            ret = pchar_set_xform(devices[i], XFORM);
+        if(ret != 0)
+        {
+            pr_err("%s: buffer allocation failed for pchar%d.\n", THIS_MODULE->name, i);
+            i = DEVCNT;
+            goto dev_alloc_failed;
+        }
+        pr_info("%s: %d fifo(s) of %d bytes allocated from pool for pchar%d\n", THIS_MODULE->name, NPRIO, FIFOSIZE, i);
+    }
 
     // allocate device numbers
     ret = alloc_chrdev_region(&devno, 0, DEVCNT, "pchar");
@@ -150,9 +839,10 @@ static int __init pchar_init(void)
     for(i=0; i<DEVCNT; i++)
      {
         devnum = MKDEV(major, i);
-        devices[i].cdev.owner = THIS_MODULE;
-        cdev_init(&devices[i].cdev, &pchar_fops);
-        ret = cdev_add(&devices[i].cdev, devnum, 1);
+        devices[i]->devno = devnum;
+        devices[i]->cdev.owner = THIS_MODULE;
+        cdev_init(&devices[i]->cdev, &pchar_fops);
+        ret = cdev_add(&devices[i]->cdev, devnum, 1);
         if(ret != 0) {
             pr_err("%s: cdev_add() failed for pchar%d.\n", THIS_MODULE->name, i);
             goto cdev_add_failed;
@@ -160,37 +850,13 @@ static int __init pchar_init(void)
         pr_info("%s: cdev_add() added cdev into kernel for pchar%d\n", THIS_MODULE->name, i);
     }
 
-    // initialize device info
-    for(i=0; i<DEVCNT; i++) 
-    {
-        devices[i].id = i;
-        devices[i].devno = MKDEV(major, i);
-        ret = kfifo_alloc(&devices[i].mybuf, MAX, GFP_KERNEL);
-        if(ret != 0) {
-            pr_err("%s: kfifo_alloc() failed for pchar%d.\n", THIS_MODULE->name, i);
-            goto kfifo_alloc_failed;
-        }
-        pr_info("%s: kfifo_alloc() allocated fifo for pchar%d\n", THIS_MODULE->name, i);
-    }
-
-    for(i=0; i<DEVCNT; i++) 
-    {
-        init_waitqueue_head(&devices[i].rd_wq);
-        pr_info("%s: wait queue initialized for pchar%d\n", THIS_MODULE->name, i);
-    }
     // all initialization successful
     return 0;
 
-kfifo_alloc_failed:
-    for(i = i - 1; i >= 0; i--) 
-    {
-        kfifo_free(&devices[i].mybuf);
-    }
-    i = DEVCNT;
 cdev_add_failed:
     for(i = i - 1; i >= 0; i--) 
     {
-        cdev_del(&devices[i].cdev);
+        cdev_del(&devices[i]->cdev);
     }
     i = DEVCNT;
 device_create_failed:
@@ -203,40 +869,41 @@ device_create_failed:
 class_create_failed:
     unregister_chrdev_region(devno, DEVCNT);
 alloc_chrdev_region_failed:
+    i = DEVCNT;
+dev_alloc_failed:
+    for(i = i - 1; i >= 0; i--)
+    {
+        pchar_free_bufs(devices[i]);
+        kmem_cache_free(caches.dev_cache, devices[i]);
+    }
     kfree(devices);
 kmalloc_failed:
+    pchar_core_caches_destroy(&caches);
     return ret;
 }
 
 static void __exit pchar_exit(void)
  {
-    int i;
+    int i, p;
     pr_info("%s: pchar_exit() called.\n", THIS_MODULE->name);
 
     // wakeup all processes sleeping in wait queues
     for(i=0; i<DEVCNT; i++) 
     {
-        wake_up_interruptible_all(&devices[i].rd_wq);
-    }
-
-    // deinitialize device info
-    for(i=0; i<DEVCNT; i++) 
-    {
-        kfifo_free(&devices[i].mybuf);
-        pr_info("%s: kfifo_free() released fifo for pchar%d\n", THIS_MODULE->name, i);
+        wake_up_interruptible_all(&devices[i]->rd_wq);
     }
 
     // delete cdev from kernel
     for(i=0; i<DEVCNT; i++)
      {
-        cdev_del(&devices[i].cdev);
+        cdev_del(&devices[i]->cdev);
         pr_info("%s: cdev_del() removed cdev from kernel for pchar%d\n", THIS_MODULE->name, i);
     }
 
     // destroy device files
     for(i=0; i<DEVCNT; i++)
      {
-        device_destroy(pclass, devices[i].devno);
+        device_destroy(pclass, devices[i]->devno);
         pr_info("%s: device_destroy() destroyed device file pchar%d\n", THIS_MODULE->name, i);
     }
 
@@ -247,6 +914,22 @@ static void __exit pchar_exit(void)
     // unregister device numbers
     unregister_chrdev_region(devno, DEVCNT);
     pr_info("%s: unregister_chrdev_region() released device numbers: major = %d\n", THIS_MODULE->name, major);
+
+    // release buffers, device structs and caches
+    for(i=0; i<DEVCNT; i++)
+    {
+        for(p=0; p<NPRIO; p++)
+        {
+            pchar_ring_t *ring = &devices[i]->ring[p];
+            pr_info("%s: pchar%d prio %d stored %llu records, %llu bytes in %llu, %lld crc errors.\n", THIS_MODULE->name, i, p,
+                    ring->stats.records, ring->stats.bytes_in, ring->stats.bytes_stored,
+                    atomic64_read(&ring->crc_errors));
+        }
+        pchar_free_bufs(devices[i]);
+        kmem_cache_free(caches.dev_cache, devices[i]);
+    }
+    kfree(devices);
+    pchar_core_caches_destroy(&caches);
 }
 
 module_init(pchar_init);
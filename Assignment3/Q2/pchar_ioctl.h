@@ -0,0 +1,71 @@
+#ifndef __PCHAR_IOCTL_H
+#define __PCHAR_IOCTL_H
+
+#include <linux/ioctl.h>
+
+// each write() is stored as one record, each read() returns one record
+
+typedef struct devinfo {
+    unsigned int size;
+    unsigned int len;
+    unsigned int avail;
+}devinfo_t;
+
+// transform applied to records on write and undone on read
+#define PCHAR_XFORM_NONE    0
+#define PCHAR_XFORM_LZ4     1
+
+// per device counters, compression ratio = bytes_in / bytes_stored
+typedef struct pchar_stats {
+    unsigned long long records;
+    unsigned long long bytes_in;        // bytes written by user space
+    unsigned long long bytes_stored;    // payload bytes kept in the ring
+    unsigned long long crc_checked;     // records verified on read
+    unsigned long long crc_errors;      // records dropped on crc mismatch (read gets -EBADMSG)
+    unsigned long long zc_records;      // large writes passed by page reference (zerocopy_min)
+}pchar_stats_t;
+
+// with PCHAR_SET_TSTAMP on, every read returns this header before the data
+typedef struct pchar_rec_hdr {
+    unsigned long long seq;             // per device write sequence number
+    unsigned long long ts_ns;           // ktime_get_ns() when queued
+    unsigned long long residency_ns;    // time spent in the FIFO
+    unsigned int len;                   // data bytes following the header
+    unsigned int flags;
+}pchar_rec_hdr_t;
+
+// queue residency, bucket[i] counts records that stayed [2^i, 2^(i+1)) ns
+#define PCHAR_HIST_BUCKETS  32
+typedef struct pchar_hist {
+    unsigned long long seq;             // next sequence number to be written
+    unsigned long long bucket[PCHAR_HIST_BUCKETS];
+}pchar_hist_t;
+
+// nprio=N module parameter gives every device N rings; a read always takes
+// the next record of the lowest numbered non-empty ring. A new open writes
+// to ring N-1, PCHAR_SET_PRIO picks another one for that file.
+#define PCHAR_PRIO_MAX      4
+// PCHAR_SET_PRIO value: every write starts with pchar_prio_hdr_t naming the ring
+#define PCHAR_PRIO_INLINE   (-1)
+typedef struct pchar_prio_hdr {
+    unsigned int prio;
+    unsigned int reserved;
+}pchar_prio_hdr_t;
+
+typedef struct pchar_prio_stats {
+    unsigned int nprio;
+    unsigned int len[PCHAR_PRIO_MAX];   // bytes queued, record headers included
+    pchar_stats_t prio[PCHAR_PRIO_MAX];
+}pchar_prio_stats_t;
+
+#define FIFO_CLEAR          _IO('x', 1)
+#define FIFO_GETINFO        _IOR('x', 2, devinfo_t)
+#define PCHAR_SET_XFORM     _IOW('x', 3, int)
+#define PCHAR_GET_STATS     _IOR('x', 4, pchar_stats_t)
+#define PCHAR_SET_CRC       _IOW('x', 5, int)  // 1 = stamp new records with crc32c
+#define PCHAR_SET_TSTAMP    _IOW('x', 6, int)  // 1 = reads return pchar_rec_hdr_t + data
+#define PCHAR_GET_HIST      _IOR('x', 7, pchar_hist_t)
+#define PCHAR_SET_PRIO      _IOW('x', 8, int)
+#define PCHAR_GET_PRIO_STATS _IOR('x', 9, pchar_prio_stats_t)
+
+#endif
@@ -0,0 +1,144 @@
+// user space record throughput test for /dev/pcharN
+// one writer and one reader thread pass records of each size through the
+// device; records below zerocopy_min are copied through the ring, larger
+// ones go by page reference
+//
+// usage: ./pchar_zc_bench [device] [MiB per size] [size ...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+static const char *devpath = "/dev/pchar0";
+static size_t mib = 256;
+static const size_t defsizes[] = { 64, 1024, 4000, 64 << 10, 1 << 20, 8 << 20 };
+
+typedef struct side {
+    pthread_t tid;
+    int fd;
+    size_t recsz;
+    long nrec;
+    long errors;
+}side_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer_fn(void *arg)
+{
+    side_t *s = arg;
+    char *buf = malloc(s->recsz);
+    long i;
+
+    if(!buf) {
+        s->errors++;
+        return NULL;
+    }
+    memset(buf, 'w', s->recsz);
+    for(i = 0; i < s->nrec; i++) {
+        if(write(s->fd, buf, s->recsz) != (ssize_t)s->recsz) {
+            s->errors++;
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+    side_t *s = arg;
+    char *buf = malloc(s->recsz);
+    long i;
+
+    if(!buf) {
+        s->errors++;
+        return NULL;
+    }
+    for(i = 0; i < s->nrec; i++) {
+        if(read(s->fd, buf, s->recsz) != (ssize_t)s->recsz) {
+            s->errors++;
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static long zerocopy_min(void)
+{
+    FILE *f = fopen("/sys/module/device/parameters/zerocopy_min", "r");
+    long val = -1;
+
+    if(f) {
+        if(fscanf(f, "%ld", &val) != 1)
+            val = -1;
+        fclose(f);
+    }
+    return val;
+}
+
+static int run(size_t recsz, long zmin)
+{
+    side_t w = { 0 }, r = { 0 };
+    double t;
+
+    w.fd = open(devpath, O_WRONLY);
+    r.fd = open(devpath, O_RDONLY);
+    if(w.fd < 0 || r.fd < 0) {
+        perror("open");
+        return -1;
+    }
+    w.recsz = r.recsz = recsz;
+    w.nrec = r.nrec = (mib << 20) / recsz + 1;
+
+    t = now_sec();
+    pthread_create(&r.tid, NULL, reader_fn, &r);
+    pthread_create(&w.tid, NULL, writer_fn, &w);
+    pthread_join(w.tid, NULL);
+    // a failed writer leaves the reader blocked
+    if(w.errors)
+        pthread_cancel(r.tid);
+    pthread_join(r.tid, NULL);
+    t = now_sec() - t;
+
+    printf("record %9zu  %-4s  %10.0f rec/s  %9.1f MiB/s  errors %ld\n", recsz,
+           zmin > 0 && recsz >= (size_t)zmin ? "zc" : "copy",
+           w.nrec / t, w.nrec * (double)recsz / t / (1 << 20), w.errors + r.errors);
+    close(w.fd);
+    close(r.fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long zmin = zerocopy_min();
+    size_t i;
+
+    if(argc > 1)
+        devpath = argv[1];
+    if(argc > 2)
+        mib = strtoul(argv[2], NULL, 0);
+    if(mib < 1) {
+        fprintf(stderr, "usage: %s [device] [MiB per size] [size ...]\n", argv[0]);
+        return 1;
+    }
+    // sizes between fifo_size and zerocopy_min are rejected with EMSGSIZE
+    if(argc > 3) {
+        for(i = 3; i < (size_t)argc; i++)
+            if(run(strtoul(argv[i], NULL, 0), zmin) < 0)
+                return 1;
+    } else {
+        for(i = 0; i < sizeof(defsizes) / sizeof(defsizes[0]); i++)
+            if(run(defsizes[i], zmin) < 0)
+                return 1;
+    }
+    return 0;
+}
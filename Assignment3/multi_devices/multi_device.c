@@ -3,220 +3,2210 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/file.h>
+#include <linux/crc32.h>
+#include <linux/scatterlist.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/rculist.h>
+#include <linux/sort.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/uio.h>
+#include <linux/shrinker.h>
+#include <linux/jiffies.h>
+#include <linux/hashtable.h>
+#include <linux/cred.h>
+#include <linux/atomic.h>
+#include "pchar_core.h"
 #include "pchar_ioctl.h"
 
-// Number of devices
+// Number of devices created at load, more can be added via /dev/pchar_ctl
 #define MAX_DEVICES 4
-#define FIFO_SIZE 32  // Size of FIFO for each device
+#define MAX_MINORS 256
+#define CTL_MINOR (MAX_MINORS - 1)  // minor of /dev/pchar_ctl
+#define FIFO_SIZE 32  // Default size of FIFO for each device
+#define FIFO_SIZE_MIN 16
+#define FIFO_SIZE_MAX (1024 * 1024)
+#define PCHAR_MARKS 64  // timestamped writes tracked per device
+#define PCHAR_MAX_FWD 4 // destinations one device can forward to
+#define PCHAR_FWD_BATCH (64 * 1024)
+#define PCHAR_SHARD_SIZE_MIN 64
 
+// end of one write in the byte stream and when it was queued
+struct pchar_mark
+{
+    unsigned int end;
+    u64 ts;
+};
+
+
+// record header in a shard ring, the payload follows
+struct pchar_shard_rec
+{
+    u64 ts;
+    u32 len;
+    u32 pad;
+};
+
+// One ring of a sharded channel. Only writers running on its cpu use it, so
+// wr_lock is uncontended unless one of them is preempted. The reader side is
+// under the channel lock and never takes wr_lock, kfifo allows one of each.
+struct pchar_shard
+{
+    struct mutex wr_lock;
+    struct kfifo fifo;
+    void *fifo_mem;
+    int cpu;
+    // reader side: payload of the current record still queued, its timestamp
+    unsigned int rd_left ____cacheline_aligned_in_smp;
+    u64 rd_ts;
+};
+
+struct pchar_dev;
+
+// src forwards everything it receives to dst; holds a reference on both
+struct pchar_link
+{
+    struct pchar_dev *src;
+    struct pchar_dev *dst;
+    struct list_head dst_node;  // on dst->up_list
+};
+
+struct pchar_dev
+{
+    // set up at create, read mostly
+    struct cdev *cdev;          // dynamically allocated, may outlive the channel
+    dev_t devno;
+    unsigned int mode;          // PCHAR_MODE_* flags
+    int node;                   // NUMA node of the ring, NUMA_NO_NODE until chosen
+    bool node_pinned;           // set explicitly, first opener does not move it
+    unsigned int rd_lowat;      // wakeup coalescing, see pchar_wmark_t
+    unsigned int rd_timeout_us;
+    unsigned int wr_lowat;
+    kuid_t owner;               // creator, ring capacity charged to it
+    unsigned long charged;      // bytes charged against uid_quota
+    struct kref ref;            // channel table + open files
+    struct pchar_shard **shards;    // PCHAR_MODE_SHARDED, by cpu
+    // forwarding; changed under pchar_lock, fwd[] also under lock
+    struct pchar_link *fwd[PCHAR_MAX_FWD];
+    unsigned int nfwd;
+    struct work_struct fwd_work;
+    struct list_head up_list;   // links into this device, RCU
+
+    // data path, all under lock; own cache lines so the read mostly part
+    // above and the sleepers below do not bounce with it
+    struct mutex lock ____cacheline_aligned_in_smp;
+    struct kfifo mybuf;
+    void *fifo_mem;             // ring storage, from the node's fifo pool or kmalloc_node;
+                                // NULL while released by the shrinker
+    bool fifo_pooled;
+    bool dead;                  // destroyed, only open files keep it alive
+    bool snap_busy;             // a snapshot is writing out the queued bytes:
+                                // no reads, clears or ring moves until done
+    unsigned int shard_next;    // round robin position of the shard merge
+    unsigned long last_used;    // jiffies of the last read or write
+    // residency tracking; wr_total/rd_total count bytes mod 2^32
+    unsigned int wr_total;
+    unsigned int rd_total;
+    unsigned int mark_head;
+    unsigned int mark_tail;
+    atomic64_t seq;             // writes so far, shard writers bump it unlocked
+    struct pchar_mark marks[PCHAR_MARKS];
+    u64 hist[PCHAR_HIST_BUCKETS];
+
+    // touched by both sides, and by wakers without the lock
+    wait_queue_head_t rd_wq ____cacheline_aligned_in_smp;
+    wait_queue_head_t wr_wq;
+    pchar_core_evt_t evt;       // eventfd / SIGIO at the fill level watermark
+    struct hrtimer rd_timer;    // wakes readers for data below rd_lowat
+    bool rd_expired;
+};
+
+// Global variables
+static int devcnt = MAX_DEVICES;
+module_param(devcnt, int, 0444);
+static int major = 250;
+static struct class *pchar_class;
+static struct cdev ctl_cdev;
+// live channels by minor; create/destroy serialized by pchar_lock
+static DEFINE_XARRAY(pchar_xa);
+static DEFINE_IDA(pchar_ida);
+static DEFINE_MUTEX(pchar_lock);
+static struct workqueue_struct *pchar_fwd_wq;
+static DEFINE_MUTEX(pchar_snap_lock);   // one snapshot or restore at a time
+// channels and their contents are saved here at unload and reloaded at init
+static char *snapshot;
+module_param(snapshot, charp, 0444);
+
+// the shrinker frees rings of empty channels untouched for idle_secs
+static unsigned int idle_secs = 30;
+module_param(idle_secs, uint, 0644);
+static struct shrinker *pchar_shrinker;
+
+// Ring capacity is charged to the uid creating the channel and a create that
+// would take it past uid_quota bytes fails with EDQUOT; 0 means no limit.
+// Capacity is charged even while the shrinker has the ring released.
+static unsigned long uid_quota;
+module_param(uid_quota, ulong, 0644);
+
+struct pchar_quota
+{
+    struct hlist_node node;
+    kuid_t uid;
+    unsigned long bytes;
+};
+static DEFINE_HASHTABLE(pchar_quota_ht, 6);
+static DEFINE_SPINLOCK(pchar_quota_lock);
+
+// dedicated caches for device structs and FIFO buffers; poolcnt buffers per
+// node stay preallocated and are recycled when a device is torn down
+static int poolcnt = MAX_DEVICES;
+module_param(poolcnt, int, 0444);
+static pchar_core_caches_t caches;
+
+static bool pchar_sharded(struct pchar_dev *dev)
+{
+    return dev->mode & PCHAR_MODE_SHARDED;
+}
+
+static void pchar_shards_free(struct pchar_dev *dev)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        if (dev->shards[cpu])
+            kfree(dev->shards[cpu]->fifo_mem);
+        kfree(dev->shards[cpu]);
+    }
+    kfree(dev->shards);
+    dev->shards = NULL;
+}
+
+// every shard and its ring live on the node of their cpu
+static int pchar_shards_alloc(struct pchar_dev *dev, unsigned int size)
+{
+    struct pchar_shard *sh;
+    int cpu;
+
+    dev->shards = kcalloc(nr_cpu_ids, sizeof(*dev->shards), GFP_KERNEL_ACCOUNT);
+    if (!dev->shards)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+    {
+        sh = kzalloc_node(sizeof(*sh), GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+        if (!sh)
+            goto failed;
+        dev->shards[cpu] = sh;
+        sh->fifo_mem = kmalloc_node(size, GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+        if (!sh->fifo_mem)
+            goto failed;
+        kfifo_init(&sh->fifo, sh->fifo_mem, size);
+        mutex_init(&sh->wr_lock);
+        sh->cpu = cpu;
+    }
+    return 0;
+
+failed:
+    pchar_shards_free(dev);
+    return -ENOMEM;
+}
+
+static struct pchar_quota *pchar_quota_find(kuid_t uid)
+{
+    struct pchar_quota *q;
+
+    hash_for_each_possible(pchar_quota_ht, q, node, __kuid_val(uid))
+        if (uid_eq(q->uid, uid))
+            return q;
+    return NULL;
+}
+
+static int pchar_quota_charge(kuid_t uid, unsigned long bytes)
+{
+    struct pchar_quota *q, *new = NULL;
+    unsigned long limit = READ_ONCE(uid_quota);
+    int ret = 0;
+
+    spin_lock(&pchar_quota_lock);
+    while (!(q = pchar_quota_find(uid)) && !new)
+    {
+        // first charge of this uid, allocate outside the lock and look again
+        spin_unlock(&pchar_quota_lock);
+        new = kzalloc(sizeof(*new), GFP_KERNEL_ACCOUNT);
+        if (!new)
+            return -ENOMEM;
+        spin_lock(&pchar_quota_lock);
+    }
+    if (limit && (q ? q->bytes : 0) + bytes > limit)
+    {
+        ret = -EDQUOT;
+        goto out;
+    }
+    if (!q)
+    {
+        q = new;
+        new = NULL;
+        q->uid = uid;
+        hash_add(pchar_quota_ht, &q->node, __kuid_val(uid));
+    }
+    q->bytes += bytes;
+out:
+    spin_unlock(&pchar_quota_lock);
+    kfree(new);
+    return ret;
+}
+
+static void pchar_quota_uncharge(kuid_t uid, unsigned long bytes)
+{
+    struct pchar_quota *q;
+
+    spin_lock(&pchar_quota_lock);
+    q = pchar_quota_find(uid);
+    if (q)
+    {
+        q->bytes -= min(q->bytes, bytes);
+        if (q->bytes)
+            q = NULL;
+        else
+            hash_del(&q->node);
+    }
+    spin_unlock(&pchar_quota_lock);
+    kfree(q);
+}
+
+// default sized rings come from the pool of their node (the local one without
+// a node), others from kmalloc_node
+static void *pchar_ring_alloc(unsigned int size, int node, bool *pooled)
+{
+    *pooled = (size == FIFO_SIZE);
+    if (*pooled)
+        return pchar_core_fifo_alloc(&caches, node, GFP_KERNEL_ACCOUNT);
+    return kmalloc_node(size, GFP_KERNEL_ACCOUNT, node);
+}
+
+static void pchar_ring_free(void *mem, bool pooled)
+{
+    if (pooled)
+        pchar_core_fifo_free(&caches, mem);
+    else
+        kfree(mem);
+}
+
+static int pchar_fifo_alloc(struct pchar_dev *dev, unsigned int size)
+{
+    if (pchar_sharded(dev))
+        return pchar_shards_alloc(dev, size);
+    dev->fifo_mem = pchar_ring_alloc(size, dev->node, &dev->fifo_pooled);
+    if (!dev->fifo_mem)
+        return -ENOMEM;
+    kfifo_init(&dev->mybuf, dev->fifo_mem, size);
+    return 0;
+}
+
+static void pchar_fifo_free(struct pchar_dev *dev)
+{
+    if (dev->shards)
+        pchar_shards_free(dev);
+    else if (dev->fifo_mem)
+        pchar_ring_free(dev->fifo_mem, dev->fifo_pooled);
+    dev->fifo_mem = NULL;
+}
+
+// bring back a ring released by the shrinker before queueing data; lock held
+static int pchar_fifo_ensure(struct pchar_dev *dev)
+{
+    if (dev->fifo_mem || pchar_sharded(dev))
+        return 0;
+    return pchar_fifo_alloc(dev, kfifo_size(&dev->mybuf));
+}
+
+static bool pchar_fifo_idle(struct pchar_dev *dev)
+{
+    return !pchar_sharded(dev) && READ_ONCE(dev->fifo_mem) && kfifo_is_empty(&dev->mybuf) &&
+           time_after(jiffies, READ_ONCE(dev->last_used) + READ_ONCE(idle_secs) * HZ);
+}
+
+// Free the ring of an idle channel. The kfifo keeps its size with no storage,
+// so it reads as empty and writable until pchar_fifo_ensure() restores it.
+static bool pchar_fifo_release(struct pchar_dev *dev)
+{
+    unsigned int size;
+    bool freed = false;
+
+    // reclaim may run under our own lock, never wait for it
+    if (!mutex_trylock(&dev->lock))
+        return false;
+    if (!dev->dead && pchar_fifo_idle(dev))
+    {
+        size = kfifo_size(&dev->mybuf);
+        pchar_fifo_free(dev);
+        kfifo_init(&dev->mybuf, NULL, size);
+        freed = true;
+    }
+    mutex_unlock(&dev->lock);
+    return freed;
+}
+
+// Move the ring to node keeping its contents; lock held
+static int pchar_fifo_migrate(struct pchar_dev *dev, int node)
+{
+    unsigned int size = kfifo_size(&dev->mybuf);
+    struct scatterlist sg[2];
+    struct kfifo newbuf;
+    unsigned int i, n;
+    bool pooled;
+    void *mem;
+
+    if (node == dev->node)
+        return 0;
+    // a snapshot is reading the old ring
+    if (dev->snap_busy)
+        return -EBUSY;
+    mem = pchar_ring_alloc(size, node, &pooled);
+    if (!mem)
+        return -ENOMEM;
+    kfifo_init(&newbuf, mem, size);
+    sg_init_table(sg, 2);
+    n = kfifo_dma_out_prepare(&dev->mybuf, sg, 2, kfifo_len(&dev->mybuf));
+    for (i = 0; i < n; i++)
+        kfifo_in(&newbuf, sg_virt(&sg[i]), sg[i].length);
+    pchar_fifo_free(dev);
+    dev->mybuf = newbuf;
+    dev->fifo_mem = mem;
+    dev->fifo_pooled = pooled;
+    dev->node = node;
+    return 0;
+}
+
+static void pchar_dev_release(struct kref *ref)
+{
+    struct pchar_dev *dev = container_of(ref, struct pchar_dev, ref);
+    // a late kick may have queued it after the last link went away
+    cancel_work_sync(&dev->fwd_work);
+    hrtimer_cancel(&dev->rd_timer);
+    pchar_core_evt_free(&dev->evt);
+    pchar_fifo_free(dev);
+    pchar_quota_uncharge(dev->owner, dev->charged);
+    kmem_cache_free(caches.dev_cache, dev);
+}
+
+static struct pchar_dev *pchar_dev_get(int minor)
+{
+    struct pchar_dev *dev;
+
+    xa_lock(&pchar_xa);
+    dev = xa_load(&pchar_xa, minor);
+    if (dev)
+        kref_get(&dev->ref);
+    xa_unlock(&pchar_xa);
+    return dev;
+}
+
+static void pchar_dev_put(struct pchar_dev *dev)
+{
+    kref_put(&dev->ref, pchar_dev_release);
+}
+
+// Residency markers: each write records where it ends in the stream and when.
+// Once reads have consumed past that point the delay goes into the histogram.
+// When all markers are in use the newest one is stretched, so under heavy
+// backlog a sample covers several writes and reports the oldest of them.
+static void pchar_mark_write(struct pchar_dev *dev, unsigned int nbytes)
+{
+    struct pchar_mark *mark;
+
+    dev->wr_total += nbytes;
+    atomic64_inc(&dev->seq);
+    if (dev->mark_head - dev->mark_tail < PCHAR_MARKS)
+    {
+        mark = &dev->marks[dev->mark_head++ % PCHAR_MARKS];
+        mark->ts = ktime_get_ns();
+    }
+    else
+        mark = &dev->marks[(dev->mark_head - 1) % PCHAR_MARKS];
+    mark->end = dev->wr_total;
+}
+
+static void pchar_mark_read(struct pchar_dev *dev, unsigned int nbytes)
+{
+    struct pchar_mark *mark;
+    u64 now = ktime_get_ns();
+
+    dev->rd_total += nbytes;
+    while (dev->mark_tail != dev->mark_head)
+    {
+        mark = &dev->marks[dev->mark_tail % PCHAR_MARKS];
+        if ((int)(dev->rd_total - mark->end) < 0)
+            break;
+        dev->hist[min_t(int, ilog2((now - mark->ts) | 1), PCHAR_HIST_BUCKETS - 1)]++;
+        dev->mark_tail++;
+    }
+}
+
+// contents dropped, pending markers are meaningless
+static void pchar_mark_reset(struct pchar_dev *dev)
+{
+    dev->rd_total = dev->wr_total;
+    dev->mark_tail = dev->mark_head;
+}
+
+// ring size, per shard for a sharded channel
+static unsigned int pchar_size(struct pchar_dev *dev)
+{
+    if (pchar_sharded(dev))
+        return kfifo_size(&dev->shards[cpumask_first(cpu_possible_mask)]->fifo);
+    return kfifo_size(&dev->mybuf);
+}
+
+// queued bytes; a sharded channel sums its shards, record headers included
+static unsigned int pchar_len(struct pchar_dev *dev)
+{
+    struct pchar_shard *sh;
+    unsigned int len = 0;
+    int cpu;
+
+    if (!pchar_sharded(dev))
+        return kfifo_len(&dev->mybuf);
+    for_each_possible_cpu(cpu)
+    {
+        sh = dev->shards[cpu];
+        len += kfifo_len(&sh->fifo) + READ_ONCE(sh->rd_left);
+    }
+    return len;
+}
+
+static unsigned int pchar_evt_len(void *arg)
+{
+    return pchar_len(arg);
+}
+
+// Signal eventfd and SIGIO owners once per rise to the watermark instead of
+// per write. Called after every fill level change, without the lock; returns
+// at once while nobody listens, so sharded writers skip the shard walk.
+static void pchar_evt_update(struct pchar_dev *dev)
+{
+    pchar_core_evt_update(&dev->evt, pchar_evt_len, dev);
+}
+
+// Readers are woken once rd_lowat bytes are queued or the rd_timer has
+// expired on older data; writers once wr_lowat bytes are free.
+static bool pchar_readable(struct pchar_dev *dev)
+{
+    unsigned int len = pchar_len(dev);
+
+    return len && !READ_ONCE(dev->snap_busy) && (len >= min_t(unsigned int, READ_ONCE(dev->rd_lowat), pchar_size(dev)) || READ_ONCE(dev->rd_expired));
+}
+
+// a shard also needs room for the record header
+static bool pchar_fifo_writable(struct pchar_dev *dev, struct kfifo *fifo, unsigned int hdr)
+{
+    return kfifo_avail(fifo) >= hdr + clamp_t(unsigned int, READ_ONCE(dev->wr_lowat), 1, kfifo_size(fifo) - hdr);
+}
+
+// for a sharded channel, writable by the cpu we run on
+static bool pchar_writable(struct pchar_dev *dev)
+{
+    if (pchar_sharded(dev))
+        return pchar_fifo_writable(dev, &dev->shards[raw_smp_processor_id()]->fifo, sizeof(struct pchar_shard_rec));
+    return pchar_fifo_writable(dev, &dev->mybuf, 0);
+}
+
+static enum hrtimer_restart pchar_rd_timer_fn(struct hrtimer *timer)
+{
+    struct pchar_dev *dev = container_of(timer, struct pchar_dev, rd_timer);
+
+    WRITE_ONCE(dev->rd_expired, true);
+    wake_up_interruptible(&dev->rd_wq);
+    return HRTIMER_NORESTART;
+}
+
+// start the age limit for data that does not reach rd_lowat yet; lock held,
+// so the queued check and the start cannot race another arm
+static void pchar_rd_timer_arm(struct pchar_dev *dev)
+{
+    unsigned int us = READ_ONCE(dev->rd_timeout_us);
+
+    if (us && pchar_len(dev) && !pchar_readable(dev) && !hrtimer_is_queued(&dev->rd_timer))
+        hrtimer_start(&dev->rd_timer, ns_to_ktime((u64)us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+}
+
+// the same from outside the lock, which is only taken when an age limit is set
+static void pchar_rd_timer_kick(struct pchar_dev *dev)
+{
+    if (!READ_ONCE(dev->rd_timeout_us))
+        return;
+    mutex_lock(&dev->lock);
+    pchar_rd_timer_arm(dev);
+    mutex_unlock(&dev->lock);
+}
+
+// data was added to dev: wake readers and push it downstream
+static void pchar_notify_readable(struct pchar_dev *dev)
+{
+    // a sharded writer must not walk every shard per write, sleepers recheck
+    if (pchar_sharded(dev))
+    {
+        if (wq_has_sleeper(&dev->rd_wq))
+            wake_up_interruptible(&dev->rd_wq);
+        pchar_rd_timer_kick(dev);
+        pchar_evt_update(dev);
+        return;
+    }
+    if (pchar_readable(dev))
+        wake_up_interruptible(&dev->rd_wq);
+    else
+        pchar_rd_timer_kick(dev);
+    pchar_evt_update(dev);
+    if (READ_ONCE(dev->nfwd))
+        queue_work(pchar_fwd_wq, &dev->fwd_work);
+}
+
+// space was freed in dev: wake writers and forwarders stalled on it
+static void pchar_notify_writable(struct pchar_dev *dev)
+{
+    struct pchar_link *link;
+
+    // pchar_writable() only sees the local shard of a sharded channel
+    if (pchar_sharded(dev) ? wq_has_sleeper(&dev->wr_wq) : pchar_writable(dev))
+        wake_up_interruptible(&dev->wr_wq);
+    pchar_evt_update(dev);
+    rcu_read_lock();
+    list_for_each_entry_rcu(link, &dev->up_list, dst_node)
+        queue_work(pchar_fwd_wq, &link->src->fwd_work);
+    rcu_read_unlock();
+}
+
+// thresholds changed, sleepers re-evaluate their conditions
+static void pchar_wmark_changed(struct pchar_dev *dev)
+{
+    mutex_lock(&dev->lock);
+    hrtimer_cancel(&dev->rd_timer);
+    pchar_rd_timer_arm(dev);
+    mutex_unlock(&dev->lock);
+    wake_up_interruptible(&dev->rd_wq);
+    wake_up_interruptible(&dev->wr_wq);
+}
+
+static int pchar_cmp_minor(const void *a, const void *b)
+{
+    const struct pchar_dev *x = *(struct pchar_dev * const *)a;
+    const struct pchar_dev *y = *(struct pchar_dev * const *)b;
+
+    return MINOR(x->devno) - MINOR(y->devno);
+}
+
+// Move one batch from src into all its destinations. The batch is limited by
+// the fullest destination, so a slow consumer holds back the whole fan-out;
+// its next read kicks us again. Locks are taken in minor order.
+static void pchar_fwd_work(struct work_struct *work)
+{
+    struct pchar_dev *src = container_of(work, struct pchar_dev, fwd_work);
+    struct pchar_dev *dsts[PCHAR_MAX_FWD], *locked[PCHAR_MAX_FWD + 1];
+    struct scatterlist sg[2];
+    unsigned int i, j, n, ndst, batch;
+
+    // links stay valid while we run, removal waits for this work
+    mutex_lock(&src->lock);
+    ndst = src->nfwd;
+    for (i = 0; i < ndst; i++)
+        dsts[i] = src->fwd[i]->dst;
+    mutex_unlock(&src->lock);
+    if (ndst == 0)
+        return;
+
+    locked[0] = src;
+    memcpy(&locked[1], dsts, ndst * sizeof(dsts[0]));
+    sort(locked, ndst + 1, sizeof(locked[0]), pchar_cmp_minor, NULL);
+    for (i = 0; i <= ndst; i++)
+        mutex_lock_nested(&locked[i]->lock, i);
+
+    batch = min_t(unsigned int, kfifo_len(&src->mybuf), PCHAR_FWD_BATCH);
+    for (i = 0; i < ndst; i++)
+        batch = pchar_fifo_ensure(dsts[i]) ? 0 : min(batch, kfifo_avail(&dsts[i]->mybuf));
+    if (src->dead || src->snap_busy)
+        batch = 0;
+    if (batch)
+    {
+        sg_init_table(sg, 2);
+        n = kfifo_dma_out_prepare(&src->mybuf, sg, 2, batch);
+        for (i = 0; i < ndst; i++)
+        {
+            for (j = 0; j < n; j++)
+                kfifo_in(&dsts[i]->mybuf, sg_virt(&sg[j]), sg[j].length);
+            pchar_mark_write(dsts[i], batch);
+        }
+        kfifo_dma_out_finish(&src->mybuf, batch);
+        pchar_mark_read(src, batch);
+    }
+
+    for (i = ndst + 1; i > 0; i--)
+        mutex_unlock(&locked[i - 1]->lock);
+
+    if (batch)
+    {
+        pchar_notify_writable(src);
+        for (i = 0; i < ndst; i++)
+            pchar_notify_readable(dsts[i]);
+        // more left, yield and come back
+        if (!kfifo_is_empty(&src->mybuf))
+            queue_work(pchar_fwd_wq, &src->fwd_work);
+    }
+}
+
+// Device operations
+static int pchar_open(struct inode *pinode, struct file *pfile)
+{
+    struct pchar_dev *dev = pchar_dev_get(iminor(pinode));
+    if (!dev)
+        return -ENODEV;
+    pfile->private_data = dev;
+    // read_iter/write_iter honour IOCB_NOWAIT, io_uring may try them inline
+    pfile->f_mode |= FMODE_NOWAIT;
+    // first opener decides where the ring lives, failure just leaves it
+    if (READ_ONCE(dev->node) == NUMA_NO_NODE)
+    {
+        mutex_lock(&dev->lock);
+        if (dev->node == NUMA_NO_NODE && !dev->node_pinned && !pchar_sharded(dev))
+            pchar_fifo_migrate(dev, numa_node_id());
+        mutex_unlock(&dev->lock);
+    }
+    printk(KERN_INFO "%s: pchar_open() called for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+    return 0;
+}
+
+static int pchar_fasync(int fd, struct file *pfile, int on)
+{
+    struct pchar_dev *dev = pfile->private_data;
+    return pchar_core_evt_fasync(&dev->evt, fd, pfile, on, pchar_evt_len, dev);
+}
+
+static int pchar_close(struct inode *pinode, struct file *pfile)
+{
+    struct pchar_dev *dev = pfile->private_data;
+    printk(KERN_INFO "%s: pchar_close() called for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+    pchar_fasync(-1, pfile, 0);
+    pchar_dev_put(dev);
+    return 0;
+}
+
+static bool pchar_may_block(struct pchar_dev *dev, struct kiocb *iocb)
+{
+    return (dev->mode & PCHAR_MODE_BLOCK) && !(iocb->ki_filp->f_flags & O_NONBLOCK) &&
+           !(iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// a NOWAIT caller must not sleep on the mutex either
+static int pchar_lock_iocb(struct pchar_dev *dev, struct kiocb *iocb)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(&dev->lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(&dev->lock) ? -ERESTARTSYS : 0;
+}
+
+// Append one record to the ring of the cpu we run on. Migrating after the
+// pick is harmless, the shard is only a locality choice. Payload is copied
+// first and the header last, so a fault can still shorten the record.
+static ssize_t pchar_shard_write(struct pchar_dev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    struct pchar_shard_rec rec = { 0 };
+    struct scatterlist sg[2];
+    struct pchar_shard *sh;
+    unsigned int i, n, len, c, skip, done = 0;
+
+    for (;;)
+    {
+        sh = dev->shards[raw_smp_processor_id()];
+        if (iocb->ki_flags & IOCB_NOWAIT)
+        {
+            if (!mutex_trylock(&sh->wr_lock))
+                return -EAGAIN;
+        }
+        else if (mutex_lock_interruptible(&sh->wr_lock))
+            return -ERESTARTSYS;
+        if (READ_ONCE(dev->dead))
+        {
+            mutex_unlock(&sh->wr_lock);
+            return -ENODEV;
+        }
+        // non-blocking writers take whatever space there is
+        if (pchar_fifo_writable(dev, &sh->fifo, sizeof(rec)) ||
+            (!pchar_may_block(dev, iocb) && kfifo_avail(&sh->fifo) > sizeof(rec)))
+            break;
+        mutex_unlock(&sh->wr_lock);
+        if (!pchar_may_block(dev, iocb))
+            return (dev->mode & PCHAR_MODE_BLOCK) ? -EAGAIN : 0;
+        if (wait_event_interruptible(dev->wr_wq, pchar_writable(dev) || READ_ONCE(dev->dead)))
+            return -ERESTARTSYS;
+    }
+
+    len = min_t(size_t, iov_iter_count(from), kfifo_avail(&sh->fifo) - sizeof(rec));
+    sg_init_table(sg, 2);
+    n = kfifo_dma_in_prepare(&sh->fifo, sg, 2, sizeof(rec) + len);
+    skip = sizeof(rec);
+    for (i = 0; i < n && done < len; i++)
+    {
+        if (skip >= sg[i].length)
+        {
+            skip -= sg[i].length;
+            continue;
+        }
+        c = copy_from_iter(sg_virt(&sg[i]) + skip, sg[i].length - skip, from);
+        done += c;
+        if (c < sg[i].length - skip)
+            break;
+        skip = 0;
+    }
+    if (done)
+    {
+        rec.ts = ktime_get_ns();
+        rec.len = done;
+        sg_pcopy_from_buffer(sg, n, &rec, sizeof(rec), 0);
+        // whole record in place before the reader can see it, as kfifo_in() does
+        smp_wmb();
+        kfifo_dma_in_finish(&sh->fifo, sizeof(rec) + done);
+        atomic64_inc(&dev->seq);
+    }
+    mutex_unlock(&sh->wr_lock);
+    if (!done)
+        return len ? -EFAULT : 0;
+    pchar_notify_readable(dev);
+    return done;
+}
+
+// pull the header of the next record of sh unless one is in progress; lock held
+static bool pchar_shard_head(struct pchar_shard *sh)
+{
+    struct pchar_shard_rec rec;
+
+    if (sh->rd_left)
+        return true;
+    // records are published whole, a header means its payload is there too
+    if (kfifo_len(&sh->fifo) < sizeof(rec))
+        return false;
+    kfifo_out(&sh->fifo, &rec, sizeof(rec));
+    WRITE_ONCE(sh->rd_left, rec.len);
+    sh->rd_ts = rec.ts;
+    return true;
+}
+
+// shard to read from next: the oldest head record if ordered, else round
+// robin from shard_next; NULL when all are empty. lock held.
+static struct pchar_shard *pchar_shard_pick(struct pchar_dev *dev)
+{
+    struct pchar_shard *sh, *best = NULL;
+    unsigned int i, cpu = dev->shard_next;
+
+    for (i = 0; i < nr_cpu_ids; i++, cpu = (cpu + 1) % nr_cpu_ids)
+    {
+        if (!cpu_possible(cpu) || !pchar_shard_head(dev->shards[cpu]))
+            continue;
+        sh = dev->shards[cpu];
+        if (!(dev->mode & PCHAR_MODE_ORDERED))
+            return sh;
+        if (!best || (s64)(sh->rd_ts - best->rd_ts) < 0)
+            best = sh;
+    }
+    return best;
+}
+
+// merge records from the shards into to; lock held
+static int pchar_shard_read(struct pchar_dev *dev, struct iov_iter *to, unsigned int *copied)
+{
+    struct pchar_shard *sh;
+    unsigned int c, done = 0;
+    int ret = 0;
+
+    while (iov_iter_count(to) && (sh = pchar_shard_pick(dev)))
+    {
+        ret = pchar_core_fifo_to_iter(&sh->fifo, to, sh->rd_left, &c);
+        WRITE_ONCE(sh->rd_left, sh->rd_left - c);
+        done += c;
+        if (ret)
+            break;
+        if (sh->rd_left == 0)
+        {
+            dev->hist[min_t(int, ilog2((ktime_get_ns() - sh->rd_ts) | 1), PCHAR_HIST_BUCKETS - 1)]++;
+            dev->shard_next = (sh->cpu + 1) % nr_cpu_ids;
+        }
+    }
+    *copied = done;
+    return done ? 0 : ret;
+}
+
+// drop everything queued in the shards; lock held, writers may keep going
+static void pchar_shards_reset(struct pchar_dev *dev)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        kfifo_reset_out(&dev->shards[cpu]->fifo);
+        WRITE_ONCE(dev->shards[cpu]->rd_left, 0);
+    }
+}
+
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct pchar_dev *dev = iocb->ki_filp->private_data;
+    unsigned int nbytes;
+    int ret;
+
+    if (pchar_sharded(dev))
+        return pchar_shard_write(dev, iocb, from);
+
+    ret = pchar_lock_iocb(dev, iocb);
+    if (ret)
+        return ret;
+    while (!pchar_writable(dev) && !dev->dead)
+    {
+        // non-blocking writers take whatever space there is
+        if (!pchar_may_block(dev, iocb) && !kfifo_is_full(&dev->mybuf))
+            break;
+        mutex_unlock(&dev->lock);
+        // -EAGAIN lets io_uring arm poll instead of parking a worker
+        if (!pchar_may_block(dev, iocb))
+            return (dev->mode & PCHAR_MODE_BLOCK) ? -EAGAIN : 0;
+        if (wait_event_interruptible(dev->wr_wq, pchar_writable(dev) || READ_ONCE(dev->dead)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+    }
+    if (dev->dead)
+    {
+        mutex_unlock(&dev->lock);
+        return -ENODEV;
+    }
+    // bringing back a ring the shrinker released may sleep, io_uring retries
+    // from a worker
+    if (!dev->fifo_mem && (iocb->ki_flags & IOCB_NOWAIT))
+    {
+        mutex_unlock(&dev->lock);
+        return -EAGAIN;
+    }
+    ret = pchar_fifo_ensure(dev);
+    if (ret)
+    {
+        mutex_unlock(&dev->lock);
+        return ret;
+    }
+    dev->last_used = jiffies;
+    ret = pchar_core_fifo_from_iter(&dev->mybuf, from, &nbytes);
+    if (nbytes > 0)
+        pchar_mark_write(dev, nbytes);
+    mutex_unlock(&dev->lock);
+    if (ret != 0)
+    {
+        printk(KERN_ERR "%s: pchar_core_fifo_from_iter() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+        return ret;
+    }
+    if (nbytes > 0)
+        pchar_notify_readable(dev);
+    return nbytes;
+}
+
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+ {
+    struct pchar_dev *dev = iocb->ki_filp->private_data;
+    unsigned int nbytes;
+    int ret;
+
+    ret = pchar_lock_iocb(dev, iocb);
+    if (ret)
+        return ret;
+    while (!pchar_readable(dev) && !dev->dead)
+    {
+        // non-blocking readers take whatever is queued
+        if (!pchar_may_block(dev, iocb) && pchar_len(dev) && !dev->snap_busy)
+            break;
+        mutex_unlock(&dev->lock);
+        if (!pchar_may_block(dev, iocb))
+            return (dev->mode & PCHAR_MODE_BLOCK) ? -EAGAIN : 0;
+        if (wait_event_interruptible(dev->rd_wq, pchar_readable(dev) || READ_ONCE(dev->dead)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+    }
+    // only a dead channel gets here during a snapshot, which still reads it
+    if (dev->snap_busy)
+        nbytes = 0;
+    else if (pchar_sharded(dev))
+        ret = pchar_shard_read(dev, to, &nbytes);
+    else
+    {
+        dev->last_used = jiffies;
+        ret = pchar_core_fifo_to_iter(&dev->mybuf, to, UINT_MAX, &nbytes);
+        if (nbytes > 0)
+            pchar_mark_read(dev, nbytes);
+    }
+    // the age limit restarts for whatever is left
+    WRITE_ONCE(dev->rd_expired, false);
+    if (!pchar_len(dev))
+        hrtimer_try_to_cancel(&dev->rd_timer);
+    else
+        pchar_rd_timer_arm(dev);
+    mutex_unlock(&dev->lock);
+    if (ret != 0)
+     {
+        printk(KERN_ERR "%s: pchar_core_fifo_to_iter() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+        return ret;
+    }
+    if (nbytes > 0)
+        pchar_notify_writable(dev);
+    return nbytes;
+}
+
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait)
+{
+    struct pchar_dev *dev = pfile->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(pfile, &dev->rd_wq, wait);
+    poll_wait(pfile, &dev->wr_wq, wait);
+    // pairs with wq_has_sleeper() in the notify helpers
+    smp_mb();
+    if (pchar_readable(dev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (pchar_writable(dev))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if (READ_ONCE(dev->dead))
+        mask |= EPOLLHUP;
+    return mask;
+}
+
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    struct pchar_dev *dev = pfile->private_data;
+    pchar_hist_t hist;
+    pchar_evfd_t evt;
+    pchar_wmark_t wm;
+    devinfo_t info;
+
+    switch (cmd)
+    {
+        case FIFO_CLEAR:
+            mutex_lock(&dev->lock);
+            if (dev->snap_busy)
+            {
+                mutex_unlock(&dev->lock);
+                return -EBUSY;
+            }
+            if (pchar_sharded(dev))
+                pchar_shards_reset(dev);
+            else
+                kfifo_reset(&dev->mybuf);
+            pchar_mark_reset(dev);
+            mutex_unlock(&dev->lock);
+            pchar_notify_writable(dev);
+            printk(KERN_INFO "%s: pchar_ioctl() dev buffer is cleared for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+            return 0;
+
+        case FIFO_GETINFO:
+            mutex_lock(&dev->lock);
+            if (pchar_sharded(dev))
+            {
+                // size and len are totals over all shards; a write only
+                // goes to the local shard, as one record behind its header
+                info.size = pchar_size(dev) * num_possible_cpus();
+                info.len = pchar_len(dev);
+                info.avail = kfifo_avail(&dev->shards[raw_smp_processor_id()]->fifo);
+                info.avail = info.avail > sizeof(struct pchar_shard_rec) ?
+                             info.avail - sizeof(struct pchar_shard_rec) : 0;
+            }
+            else
+            {
+                info.size = kfifo_size(&dev->mybuf);
+                info.len = kfifo_len(&dev->mybuf);
+                info.avail = kfifo_avail(&dev->mybuf);
+            }
+            mutex_unlock(&dev->lock);
+            if (copy_to_user((void __user *)param, &info, sizeof(info)))
+            {
+                printk(KERN_ERR "%s: copy_to_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+                return -EFAULT;
+            }
+            return 0;
+
+        case FIFO_GETHIST:
+            mutex_lock(&dev->lock);
+            hist.seq = atomic64_read(&dev->seq);
+            memcpy(hist.bucket, dev->hist, sizeof(hist.bucket));
+            mutex_unlock(&dev->lock);
+            if (copy_to_user((void __user *)param, &hist, sizeof(hist)))
+                return -EFAULT;
+            return 0;
+
+        case PCHAR_SET_EVENTFD:
+            if (copy_from_user(&evt, (void __user *)param, sizeof(evt)))
+                return -EFAULT;
+            return pchar_core_evt_set(&dev->evt, evt.fd, evt.watermark, pchar_evt_len, dev);
+
+        case PCHAR_SET_WMARK:
+            if (copy_from_user(&wm, (void __user *)param, sizeof(wm)))
+                return -EFAULT;
+            WRITE_ONCE(dev->rd_lowat, wm.rd_bytes);
+            WRITE_ONCE(dev->rd_timeout_us, wm.rd_usecs);
+            WRITE_ONCE(dev->wr_lowat, wm.wr_bytes);
+            pchar_wmark_changed(dev);
+            return 0;
+
+        case PCHAR_GET_WMARK:
+            wm.rd_bytes = READ_ONCE(dev->rd_lowat);
+            wm.rd_usecs = READ_ONCE(dev->rd_timeout_us);
+            wm.wr_bytes = READ_ONCE(dev->wr_lowat);
+            if (copy_to_user((void __user *)param, &wm, sizeof(wm)))
+                return -EFAULT;
+            return 0;
+
+        default:
+            printk(KERN_ERR "%s: Invalid ioctl command for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+            return -EINVAL;
+    }
+}
+
+// File operations structure
+static struct file_operations pchar_fops = {
+    .owner = THIS_MODULE,
+    .open = pchar_open,
+    .release = pchar_close,
+    .write_iter = pchar_write_iter,
+    .read_iter = pchar_read_iter,
+    .poll = pchar_poll,
+    .fasync = pchar_fasync,
+    .unlocked_ioctl = pchar_ioctl
+};
+
+// sysfs: /sys/class/pchar_class/pcharN/numa_node, -1 returns to first opener
+static ssize_t numa_node_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct pchar_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(dev->node));
+}
+
+static ssize_t numa_node_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct pchar_dev *dev = dev_get_drvdata(device);
+    int node, ret;
+
+    ret = kstrtoint(buf, 0, &node);
+    if (ret)
+        return ret;
+    if (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return -EINVAL;
+    // shards already follow their cpus
+    if (pchar_sharded(dev))
+        return -EINVAL;
+    mutex_lock(&dev->lock);
+    if (node == NUMA_NO_NODE)
+    {
+        dev->node_pinned = false;
+        WRITE_ONCE(dev->node, NUMA_NO_NODE);
+    }
+    else
+    {
+        ret = pchar_fifo_migrate(dev, node);
+        if (!ret)
+            dev->node_pinned = true;
+    }
+    mutex_unlock(&dev->lock);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(numa_node);
+
+// sysfs: rd_lowat, rd_timeout_us, wr_lowat, same as PCHAR_SET_WMARK
+#define PCHAR_WMARK_ATTR(name) \
+static ssize_t name##_show(struct device *device, struct device_attribute *attr, char *buf) \
+{ \
+    struct pchar_dev *dev = dev_get_drvdata(device); \
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->name)); \
+} \
+static ssize_t name##_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count) \
+{ \
+    struct pchar_dev *dev = dev_get_drvdata(device); \
+    unsigned int val; \
+    int ret = kstrtouint(buf, 0, &val); \
+    if (ret) \
+        return ret; \
+    WRITE_ONCE(dev->name, val); \
+    pchar_wmark_changed(dev); \
+    return count; \
+} \
+static DEVICE_ATTR_RW(name)
+
+// sysfs: mem_bytes, channel struct plus ring storage currently allocated
+static ssize_t mem_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct pchar_dev *dev = dev_get_drvdata(device);
+    unsigned long bytes = sizeof(*dev);
+
+    mutex_lock(&dev->lock);
+    if (pchar_sharded(dev))
+        bytes += (unsigned long)num_possible_cpus() * (sizeof(struct pchar_shard) + pchar_size(dev));
+    else if (dev->fifo_mem)
+        bytes += kfifo_size(&dev->mybuf);
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%lu\n", bytes);
+}
+static DEVICE_ATTR_RO(mem_bytes);
+
+PCHAR_WMARK_ATTR(rd_lowat);
+PCHAR_WMARK_ATTR(rd_timeout_us);
+PCHAR_WMARK_ATTR(wr_lowat);
+
+static struct attribute *pchar_dev_attrs[] = {
+    &dev_attr_numa_node.attr,
+    &dev_attr_rd_lowat.attr,
+    &dev_attr_rd_timeout_us.attr,
+    &dev_attr_wr_lowat.attr,
+    &dev_attr_mem_bytes.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(pchar_dev);
+
+// Create /dev/pchar<minor>; minor < 0 picks the lowest free one.
+// Returns the new channel with a reference the caller drops with pchar_dev_put();
+// a concurrent destroy can unpublish it as soon as pchar_lock is released.
+static struct pchar_dev *pchar_dev_create(int minor, unsigned int size, unsigned int mode, int node)
+{
+    struct pchar_dev *dev;
+    struct device *pdevice;
+    int ret;
+
+    if (size == 0)
+        size = FIFO_SIZE;
+    if (size < FIFO_SIZE_MIN || size > FIFO_SIZE_MAX ||
+        (mode & ~(PCHAR_MODE_BLOCK | PCHAR_MODE_SHARDED | PCHAR_MODE_ORDERED)))
+        return ERR_PTR(-EINVAL);
+    if ((mode & PCHAR_MODE_SHARDED) && (size < PCHAR_SHARD_SIZE_MIN || node != NUMA_NO_NODE))
+        return ERR_PTR(-EINVAL);
+    if ((mode & PCHAR_MODE_ORDERED) && !(mode & PCHAR_MODE_SHARDED))
+        return ERR_PTR(-EINVAL);
+    size = roundup_pow_of_two(size);
+    if (minor >= CTL_MINOR)
+        return ERR_PTR(-EINVAL);
+    if (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return ERR_PTR(-EINVAL);
+
+    mutex_lock(&pchar_lock);
+    if (minor < 0)
+        ret = ida_alloc_max(&pchar_ida, CTL_MINOR - 1, GFP_KERNEL);
+    else
+        ret = ida_alloc_range(&pchar_ida, minor, minor, GFP_KERNEL);
+    if (ret < 0)
+    {
+        printk(KERN_ERR "%s: no free minor for new device (%d).\n", THIS_MODULE->name, ret);
+        ret = (ret == -ENOSPC && minor >= 0) ? -EEXIST : ret;
+        goto ida_failed;
+    }
+    minor = ret;
+
+    // without a node the struct stays on the creator's node
+    dev = kmem_cache_alloc_node(caches.dev_cache, GFP_KERNEL_ACCOUNT | __GFP_ZERO, node);
+    if (!dev)
+    {
+        printk(KERN_ERR "%s: kmem_cache_alloc_node() failed for device %d.\n", THIS_MODULE->name, minor);
+        ret = -ENOMEM;
+        goto dev_alloc_failed;
+    }
+    dev->node = node;
+    dev->node_pinned = (node != NUMA_NO_NODE);
+    dev->mode = mode;
+    dev->owner = current_uid();
+    dev->charged = (mode & PCHAR_MODE_SHARDED) ? (unsigned long)size * num_possible_cpus() : size;
+    ret = pchar_quota_charge(dev->owner, dev->charged);
+    if (ret)
+    {
+        printk(KERN_ERR "%s: quota charge failed for uid %u, device %d.\n", THIS_MODULE->name,
+               from_kuid(&init_user_ns, dev->owner), minor);
+        goto quota_failed;
+    }
+    ret = pchar_fifo_alloc(dev, size);
+    if (ret)
+    {
+        printk(KERN_ERR "%s: fifo allocation failed for device %d.\n", THIS_MODULE->name, minor);
+        goto fifo_alloc_failed;
+    }
+    dev->devno = MKDEV(major, minor);
+    mutex_init(&dev->lock);
+    init_waitqueue_head(&dev->rd_wq);
+    init_waitqueue_head(&dev->wr_wq);
+    INIT_WORK(&dev->fwd_work, pchar_fwd_work);
+    INIT_LIST_HEAD(&dev->up_list);
+    pchar_core_evt_init(&dev->evt);
+    dev->rd_lowat = 1;
+    dev->wr_lowat = 1;
+    dev->last_used = jiffies;
+    hrtimer_setup(&dev->rd_timer, pchar_rd_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    kref_init(&dev->ref);
+
+    // visible to open() before the cdev goes live
+    ret = xa_err(xa_store(&pchar_xa, minor, dev, GFP_KERNEL));
+    if (ret)
+        goto xa_store_failed;
+
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev)
+    {
+        ret = -ENOMEM;
+        goto cdev_alloc_failed;
+    }
+    dev->cdev->ops = &pchar_fops;
+    dev->cdev->owner = THIS_MODULE;
+    ret = cdev_add(dev->cdev, dev->devno, 1);
+    if (ret)
+    {
+        printk(KERN_ERR "%s: cdev_add() failed for device %d.\n", THIS_MODULE->name, minor);
+        kobject_put(&dev->cdev->kobj);
+        goto cdev_alloc_failed;
+    }
+
+    pdevice = device_create_with_groups(pchar_class, NULL, dev->devno, dev, pchar_dev_groups, "pchar%d", minor);
+    if (IS_ERR(pdevice))
+    {
+        printk(KERN_ERR "%s: device_create() failed for device %d.\n", THIS_MODULE->name, minor);
+        ret = PTR_ERR(pdevice);
+        cdev_del(dev->cdev);
+        goto cdev_alloc_failed;
+    }
+    kref_get(&dev->ref);
+    mutex_unlock(&pchar_lock);
+    printk(KERN_INFO "%s: created device pchar%d, fifo %u bytes, mode %#x, node %d.\n", THIS_MODULE->name, minor, size, mode, node);
+    return dev;
+
+cdev_alloc_failed:
+    // an open() may already hold a reference, let the last put free it
+    xa_erase(&pchar_xa, minor);
+    dev->dead = true;
+    ida_free(&pchar_ida, minor);
+    mutex_unlock(&pchar_lock);
+    pchar_dev_put(dev);
+    return ERR_PTR(ret);
+xa_store_failed:
+    pchar_fifo_free(dev);
+fifo_alloc_failed:
+    pchar_quota_uncharge(dev->owner, dev->charged);
+quota_failed:
+    kmem_cache_free(caches.dev_cache, dev);
+dev_alloc_failed:
+    ida_free(&pchar_ida, minor);
+ida_failed:
+    mutex_unlock(&pchar_lock);
+    return ERR_PTR(ret);
+}
 
-struct pchar_dev 
+// Can data written to from reach to through forwarding links? pchar_lock held.
+static bool pchar_fwd_reaches(struct pchar_dev *from, struct pchar_dev *to)
 {
-    struct cdev cdev;           
-    struct kfifo mybuf;        
-    dev_t devno;                
-};
+    struct pchar_dev **queue;
+    unsigned long *seen;
+    unsigned int head = 0, tail = 0, i;
+    bool found = false;
 
-// Global variables
-static struct pchar_dev *pchar_devices[MAX_DEVICES];  
-static int major = 250;                               
-static struct class *pchar_class;                      
+    queue = kmalloc_array(MAX_MINORS, sizeof(*queue), GFP_KERNEL);
+    seen = bitmap_zalloc(MAX_MINORS, GFP_KERNEL);
+    if (!queue || !seen)
+    {
+        // refuse rather than risk a loop
+        found = true;
+        goto out;
+    }
+    queue[tail++] = from;
+    __set_bit(MINOR(from->devno), seen);
+    while (head < tail && !found)
+    {
+        from = queue[head++];
+        for (i = 0; i < from->nfwd; i++)
+        {
+            if (from->fwd[i]->dst == to)
+                found = true;
+            else if (!__test_and_set_bit(MINOR(from->fwd[i]->dst->devno), seen))
+                queue[tail++] = from->fwd[i]->dst;
+        }
+    }
+out:
+    bitmap_free(seen);
+    kfree(queue);
+    return found;
+}
 
-// Device operations
-static int pchar_open(struct inode *pinode, struct file *pfile) 
+static int pchar_link_add(int src_minor, int dst_minor)
 {
-    struct pchar_dev *dev = container_of(pinode->i_cdev, struct pchar_dev, cdev);
-    pfile->private_data = dev; 
-    printk(KERN_INFO "%s: pchar_open() called for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+    struct pchar_dev *src, *dst;
+    struct pchar_link *link;
+    unsigned int i;
+    int ret = 0;
+
+    if (src_minor == dst_minor)
+        return -EINVAL;
+    link = kzalloc(sizeof(*link), GFP_KERNEL_ACCOUNT);
+    if (!link)
+        return -ENOMEM;
+
+    mutex_lock(&pchar_lock);
+    src = pchar_dev_get(src_minor);
+    dst = pchar_dev_get(dst_minor);
+    if (!src || !dst)
+    {
+        ret = -ENODEV;
+        goto failed;
+    }
+    // forwarding moves raw bytes between single rings
+    if (pchar_sharded(src) || pchar_sharded(dst))
+    {
+        ret = -EOPNOTSUPP;
+        goto failed;
+    }
+    if (src->nfwd == PCHAR_MAX_FWD)
+        ret = -ENOSPC;
+    for (i = 0; i < src->nfwd; i++)
+        if (src->fwd[i]->dst == dst)
+            ret = -EEXIST;
+    if (!ret && pchar_fwd_reaches(dst, src))
+        ret = -ELOOP;
+    if (ret)
+        goto failed;
+
+    link->src = src;
+    link->dst = dst;
+    list_add_tail_rcu(&link->dst_node, &dst->up_list);
+    mutex_lock(&src->lock);
+    src->fwd[src->nfwd] = link;
+    WRITE_ONCE(src->nfwd, src->nfwd + 1);
+    mutex_unlock(&src->lock);
+    mutex_unlock(&pchar_lock);
+    // move what is already queued
+    queue_work(pchar_fwd_wq, &src->fwd_work);
+    printk(KERN_INFO "%s: pchar%d now forwards to pchar%d.\n", THIS_MODULE->name, src_minor, dst_minor);
     return 0;
+
+failed:
+    mutex_unlock(&pchar_lock);
+    if (src)
+        pchar_dev_put(src);
+    if (dst)
+        pchar_dev_put(dst);
+    kfree(link);
+    return ret;
+}
+
+// pchar_lock held
+static void pchar_link_del(struct pchar_link *link)
+{
+    struct pchar_dev *src = link->src;
+    unsigned int i;
+
+    mutex_lock(&src->lock);
+    for (i = 0; i < src->nfwd; i++)
+        if (src->fwd[i] == link)
+            break;
+    src->fwd[i] = src->fwd[src->nfwd - 1];
+    WRITE_ONCE(src->nfwd, src->nfwd - 1);
+    mutex_unlock(&src->lock);
+    list_del_rcu(&link->dst_node);
+
+    // no kick can find the link any more, then let a running batch finish
+    synchronize_rcu();
+    cancel_work_sync(&src->fwd_work);
+    if (READ_ONCE(src->nfwd))
+        queue_work(pchar_fwd_wq, &src->fwd_work);
+
+    pchar_dev_put(link->dst);
+    pchar_dev_put(src);
+    kfree(link);
+}
+
+static int pchar_link_remove(int src_minor, int dst_minor)
+{
+    struct pchar_dev *src;
+    struct pchar_link *link;
+    int i, found = 0;
+
+    mutex_lock(&pchar_lock);
+    src = xa_load(&pchar_xa, src_minor);
+    if (!src)
+    {
+        mutex_unlock(&pchar_lock);
+        return -ENODEV;
+    }
+    // removal swaps in the last entry, which was already looked at
+    for (i = src->nfwd - 1; i >= 0; i--)
+    {
+        link = src->fwd[i];
+        if (dst_minor < 0 || MINOR(link->dst->devno) == dst_minor)
+        {
+            pchar_link_del(link);
+            found++;
+        }
+    }
+    mutex_unlock(&pchar_lock);
+    return found ? 0 : -ENOENT;
 }
 
-static int pchar_close(struct inode *pinode, struct file *pfile) 
+// Remove /dev/pchar<minor>; open files keep the struct until closed
+static int pchar_dev_destroy(int minor)
 {
-    printk(KERN_INFO "%s: pchar_close() called.\n", THIS_MODULE->name);
+    struct pchar_dev *dev;
+
+    mutex_lock(&pchar_lock);
+    dev = xa_erase(&pchar_xa, minor);
+    if (!dev)
+    {
+        mutex_unlock(&pchar_lock);
+        return -ENODEV;
+    }
+    device_destroy(pchar_class, dev->devno);
+    cdev_del(dev->cdev);
+
+    // cut it out of the forwarding graph in both directions
+    while (dev->nfwd)
+        pchar_link_del(dev->fwd[dev->nfwd - 1]);
+    while (!list_empty(&dev->up_list))
+        pchar_link_del(list_first_entry(&dev->up_list, struct pchar_link, dst_node));
+
+    mutex_lock(&dev->lock);
+    dev->dead = true;
+    mutex_unlock(&dev->lock);
+    wake_up_interruptible_all(&dev->rd_wq);
+    wake_up_interruptible_all(&dev->wr_wq);
+
+    ida_free(&pchar_ida, minor);
+    mutex_unlock(&pchar_lock);
+    pchar_dev_put(dev);
+    printk(KERN_INFO "%s: destroyed device pchar%d.\n", THIS_MODULE->name, minor);
     return 0;
 }
 
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t bufsize, loff_t *pf_pos) {
-    struct pchar_dev *dev = pfile->private_data;
-    int nbytes, ret;
-    ret = kfifo_from_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0) 
+// Snapshot/restore. Queued bytes stream straight between the rings and the
+// file through the kfifo scatterlist helpers, no intermediate buffer. Neither
+// side holds pchar_lock or a channel lock while doing file I/O.
+static int snap_write(struct file *filp, const void *buf, size_t len, loff_t *pos)
+{
+    ssize_t ret;
+
+    while (len)
     {
-        printk(KERN_ERR "%s: kfifo_from_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-        return ret;
+        ret = kernel_write(filp, buf, len, pos);
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            return -EIO;
+        buf += ret;
+        len -= ret;
     }
-    printk(KERN_INFO "%s: pchar_write() written %d bytes to device %d.\n", THIS_MODULE->name, nbytes, MINOR(dev->devno));
-    return nbytes;
+    return 0;
 }
 
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t bufsize, loff_t *pf_pos)
- {
-    struct pchar_dev *dev = pfile->private_data;
-    int ret, nbytes;
-    ret = kfifo_to_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0)
-     {
-        printk(KERN_ERR "%s: kfifo_to_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-        return ret;
+static int snap_read(struct file *filp, void *buf, size_t len, loff_t *pos)
+{
+    ssize_t ret;
+
+    while (len)
+    {
+        ret = kernel_read(filp, buf, len, pos);
+        if (ret < 0)
+            return ret;
+        if (ret == 0)
+            return -EBADMSG;    // truncated stream
+        buf += ret;
+        len -= ret;
     }
-    printk(KERN_INFO "%s: pchar_read() read %d bytes from device %d.\n", THIS_MODULE->name, nbytes, MINOR(dev->devno));
-    return nbytes;
+    return 0;
 }
 
-static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param) 
+// what a snapshot saves of one ring, taken under the lock
+struct pchar_snap_view
 {
-    struct pchar_dev *dev = pfile->private_data;
-    devinfo_t info;
+    unsigned int len;           // ring bytes
+    unsigned int left;          // payload of a started shard record, saved
+    u64 ts;                     // behind a new header with this timestamp
+};
+
+// Hand buf to filp, or with filp NULL only fold it into crc; the record
+// crc has to be known before the record is written.
+static int snap_emit(struct file *filp, const void *buf, size_t len, u32 *crc, loff_t *pos)
+{
+    if (!filp)
+    {
+        *crc = crc32_le(*crc, buf, len);
+        return 0;
+    }
+    return snap_write(filp, buf, len, pos);
+}
+
+static int snap_emit_fifo(struct file *filp, struct kfifo *fifo, unsigned int len, u32 *crc, loff_t *pos)
+{
+    struct scatterlist sg[2];
+    unsigned int i, n;
+    int ret = 0;
+
+    sg_init_table(sg, 2);
+    n = len ? kfifo_dma_out_prepare(fifo, sg, 2, len) : 0;
+    for (i = 0; i < n && !ret; i++)
+        ret = snap_emit(filp, sg_virt(&sg[i]), sg[i].length, crc, pos);
+    return ret;
+}
+
+// the len bytes of a held channel in stream order, see pchar_snap_shard_t
+static int pchar_snap_data(struct pchar_dev *dev, struct pchar_snap_view *views,
+                           struct file *filp, u32 *crc, loff_t *pos)
+{
+    struct pchar_shard_rec hdr = { 0 };
+    struct pchar_snap_view *v;
+    pchar_snap_shard_t sec;
+    int cpu, ret = 0;
+
+    if (!pchar_sharded(dev))
+        return snap_emit_fifo(filp, &dev->mybuf, views[0].len, crc, pos);
+    for_each_possible_cpu(cpu)
+    {
+        v = &views[cpu];
+        sec.cpu = cpu;
+        sec.len = v->len + (v->left ? sizeof(hdr) : 0);
+        if (!sec.len)
+            continue;
+        ret = snap_emit(filp, &sec, sizeof(sec), crc, pos);
+        if (!ret && v->left)
+        {
+            hdr.ts = v->ts;
+            hdr.len = v->left;
+            ret = snap_emit(filp, &hdr, sizeof(hdr), crc, pos);
+        }
+        if (!ret)
+            ret = snap_emit_fifo(filp, &dev->shards[cpu]->fifo, v->len, crc, pos);
+        if (ret)
+            break;
+    }
+    return ret;
+}
+
+// Save one channel. The queued bytes are written straight from the ring
+// without the lock: snap_busy keeps readers, clears and ring moves off them
+// meanwhile, writers keep appending behind them.
+static int pchar_snapshot_one(struct pchar_dev *dev, struct pchar_snap_view *views,
+                              struct file *filp, loff_t *pos, size_t *total)
+{
+    pchar_snap_rec_t rec;
+    struct pchar_shard *sh;
+    u64 len = 0;
+    int cpu, ret;
+    u32 crc;
+
+    mutex_lock(&dev->lock);
+    if (dev->dead)
+    {
+        mutex_unlock(&dev->lock);
+        return 0;
+    }
+    rec.minor = MINOR(dev->devno);
+    rec.size = pchar_size(dev);
+    rec.mode = dev->mode;
+    if (pchar_sharded(dev))
+    {
+        for_each_possible_cpu(cpu)
+        {
+            sh = dev->shards[cpu];
+            views[cpu].len = kfifo_len(&sh->fifo);
+            views[cpu].left = sh->rd_left;
+            views[cpu].ts = sh->rd_ts;
+            if (views[cpu].len || views[cpu].left)
+                len += sizeof(pchar_snap_shard_t) + views[cpu].len +
+                       (views[cpu].left ? sizeof(struct pchar_shard_rec) : 0);
+        }
+        // shard writers publish without the lock, as in kfifo_out()
+        smp_rmb();
+    }
+    else
+        len = views[0].len = kfifo_len(&dev->mybuf);
+    if (len > UINT_MAX)
+    {
+        mutex_unlock(&dev->lock);
+        return -EFBIG;
+    }
+    rec.len = len;
+    dev->snap_busy = rec.len != 0;
+    mutex_unlock(&dev->lock);
+
+    crc = crc32_le(~0, (void *)&rec, offsetof(pchar_snap_rec_t, crc));
+    pchar_snap_data(dev, views, NULL, &crc, NULL);
+    rec.crc = crc;
+    ret = snap_write(filp, &rec, sizeof(rec), pos);
+    if (!ret)
+        ret = pchar_snap_data(dev, views, filp, &crc, pos);
+
+    if (rec.len)
+    {
+        mutex_lock(&dev->lock);
+        dev->snap_busy = false;
+        mutex_unlock(&dev->lock);
+        // readers and forwarding held back meanwhile
+        pchar_notify_readable(dev);
+    }
+    *total += rec.len;
+    return ret;
+}
+
+// next live channel from *minor on, with a reference; NULL after the last
+static struct pchar_dev *pchar_dev_get_next(unsigned long *minor)
+{
+    struct pchar_dev *dev;
+
+    xa_lock(&pchar_xa);
+    dev = xa_find(&pchar_xa, minor, ULONG_MAX, XA_PRESENT);
+    if (dev)
+        kref_get(&dev->ref);
+    xa_unlock(&pchar_xa);
+    return dev;
+}
+
+// Write every channel and its queued bytes to filp, contents are not
+// consumed. pchar_lock is not held, so a slow target only holds up the
+// readers of the channel being written; channels created or destroyed
+// meanwhile may or may not be in the stream.
+static int pchar_snapshot(struct file *filp)
+{
+    pchar_snap_hdr_t hdr = { .magic = PCHAR_SNAP_MAGIC, .version = PCHAR_SNAP_VERSION };
+    struct pchar_snap_view *views;
+    pchar_snap_rec_t rec;
+    struct pchar_dev *dev;
+    unsigned long minor;
+    unsigned int count = 0;
+    size_t total = 0;
+    loff_t pos;
     int ret;
 
-    switch (cmd) 
+    views = kcalloc(nr_cpu_ids, sizeof(*views), GFP_KERNEL);
+    if (!views)
+        return -ENOMEM;
+    mutex_lock(&pchar_snap_lock);
+    pos = filp->f_pos;
+    hdr.crc = crc32_le(~0, (void *)&hdr, offsetof(pchar_snap_hdr_t, crc));
+    ret = snap_write(filp, &hdr, sizeof(hdr), &pos);
+    for (minor = 0; !ret && (dev = pchar_dev_get_next(&minor)); minor++)
     {
-        case FIFO_CLEAR:
-            kfifo_reset(&dev->mybuf);  
-            printk(KERN_INFO "%s: pchar_ioctl() dev buffer is cleared for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-            return 0;
-        
-        case FIFO_GETINFO:
-            info.size = kfifo_size(&dev->mybuf);
-            info.len = kfifo_len(&dev->mybuf);
-            info.avail = kfifo_avail(&dev->mybuf);
-            ret = copy_to_user((void *)param, &info, sizeof(info));
-            if (ret < 0) 
-            {
-                printk(KERN_ERR "%s: copy_to_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-                return ret;
-            }
-            printk(KERN_INFO "%s: pchar_ioctl() read dev buffer info for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+        ret = pchar_snapshot_one(dev, views, filp, &pos, &total);
+        pchar_dev_put(dev);
+        count++;
+    }
+    if (!ret)
+    {
+        memset(&rec, 0, sizeof(rec));
+        rec.minor = PCHAR_SNAP_END;
+        rec.crc = crc32_le(~0, (void *)&rec, offsetof(pchar_snap_rec_t, crc));
+        ret = snap_write(filp, &rec, sizeof(rec), &pos);
+    }
+    filp->f_pos = pos;
+    mutex_unlock(&pchar_snap_lock);
+    kfree(views);
+    if (ret)
+        printk(KERN_ERR "%s: snapshot failed (%d).\n", THIS_MODULE->name, ret);
+    else
+        printk(KERN_INFO "%s: snapshot saved %u devices, %zu bytes queued.\n", THIS_MODULE->name, count, total);
+    return ret;
+}
+
+// read len bytes of the stream straight into the free space of fifo
+static int snap_read_fifo(struct file *filp, struct kfifo *fifo, unsigned int len, u32 *crc, loff_t *pos)
+{
+    struct scatterlist sg[2];
+    unsigned int i, n;
+    int ret;
+
+    if (len > kfifo_avail(fifo))
+        return -ENOSPC;
+    sg_init_table(sg, 2);
+    n = len ? kfifo_dma_in_prepare(fifo, sg, 2, len) : 0;
+    for (i = 0; i < n; i++)
+    {
+        ret = snap_read(filp, sg_virt(&sg[i]), sg[i].length, pos);
+        if (ret)
+            return ret;
+        *crc = crc32_le(*crc, sg_virt(&sg[i]), sg[i].length);
+    }
+    kfifo_dma_in_finish(fifo, len);
+    return 0;
+}
+
+// Load rec into a new ring and swap it in once the crc matched; the old
+// ring and its contents are dropped.
+static int pchar_restore_fifo(struct pchar_dev *dev, struct file *filp, pchar_snap_rec_t *rec, u32 crc, loff_t *pos)
+{
+    struct kfifo newbuf;
+    unsigned int size;
+    bool pooled;
+    void *mem;
+    int node, ret;
+
+    mutex_lock(&dev->lock);
+    size = kfifo_size(&dev->mybuf);
+    node = dev->node;
+    mutex_unlock(&dev->lock);
+    if (rec->len > size)
+        return -ENOSPC;
+    mem = pchar_ring_alloc(size, node, &pooled);
+    if (!mem)
+        return -ENOMEM;
+    kfifo_init(&newbuf, mem, size);
+    ret = snap_read_fifo(filp, &newbuf, rec->len, &crc, pos);
+    if (!ret && crc != rec->crc)
+        ret = -EBADMSG;
+
+    mutex_lock(&dev->lock);
+    if (!ret && dev->dead)
+        ret = -ENODEV;
+    if (!ret)
+    {
+        swap(dev->mybuf, newbuf);
+        swap(dev->fifo_mem, mem);
+        swap(dev->fifo_pooled, pooled);
+        dev->last_used = jiffies;
+        pchar_mark_reset(dev);
+        if (rec->len)
+            pchar_mark_write(dev, rec->len);
+    }
+    mutex_unlock(&dev->lock);
+    // the old ring, or the new one if it was not used
+    if (mem)
+        pchar_ring_free(mem, pooled);
+    return ret;
+}
+
+// as pchar_restore_fifo() with a new ring per shard, each swapped in under
+// its writer lock
+static int pchar_restore_shards(struct pchar_dev *dev, struct file *filp, pchar_snap_rec_t *rec, u32 crc, loff_t *pos)
+{
+    unsigned int left = rec->len, size = pchar_size(dev);
+    struct kfifo *newf;
+    struct pchar_shard *sh;
+    pchar_snap_shard_t sec;
+    void **mem;
+    int cpu, ret = 0;
+
+    newf = kcalloc(nr_cpu_ids, sizeof(*newf), GFP_KERNEL);
+    mem = kcalloc(nr_cpu_ids, sizeof(*mem), GFP_KERNEL);
+    if (!newf || !mem)
+    {
+        ret = -ENOMEM;
+        goto free;
+    }
+    for_each_possible_cpu(cpu)
+    {
+        mem[cpu] = kmalloc_node(size, GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+        if (!mem[cpu])
+        {
+            ret = -ENOMEM;
+            goto free;
+        }
+        kfifo_init(&newf[cpu], mem[cpu], size);
+    }
+    while (left)
+    {
+        if (left < sizeof(sec))
+        {
+            ret = -EBADMSG;
+            goto free;
+        }
+        ret = snap_read(filp, &sec, sizeof(sec), pos);
+        if (ret)
+            goto free;
+        crc = crc32_le(crc, (void *)&sec, sizeof(sec));
+        left -= sizeof(sec);
+        if (sec.len > left)
+        {
+            ret = -EBADMSG;
+            goto free;
+        }
+        // the shard is only a locality choice, a cpu gone since goes to the first
+        if (sec.cpu >= nr_cpu_ids || !cpu_possible(sec.cpu))
+            sec.cpu = cpumask_first(cpu_possible_mask);
+        ret = snap_read_fifo(filp, &newf[sec.cpu], sec.len, &crc, pos);
+        if (ret)
+            goto free;
+        left -= sec.len;
+    }
+    if (crc != rec->crc)
+    {
+        ret = -EBADMSG;
+        goto free;
+    }
+
+    mutex_lock(&dev->lock);
+    if (dev->dead)
+        ret = -ENODEV;
+    else
+    {
+        for_each_possible_cpu(cpu)
+        {
+            sh = dev->shards[cpu];
+            mutex_lock(&sh->wr_lock);
+            swap(sh->fifo, newf[cpu]);
+            swap(sh->fifo_mem, mem[cpu]);
+            WRITE_ONCE(sh->rd_left, 0);
+            mutex_unlock(&sh->wr_lock);
+        }
+        pchar_mark_reset(dev);
+    }
+    mutex_unlock(&dev->lock);
+free:
+    // old rings after the swap, else the unused new ones
+    if (mem)
+        for_each_possible_cpu(cpu)
+            kfree(mem[cpu]);
+    kfree(mem);
+    kfree(newf);
+    return ret;
+}
+
+// Load one channel record; creates the channel if needed and replaces its
+// contents. The payload goes straight into a new ring, which replaces the
+// old one only when the crc matched, so a corrupt or truncated record
+// leaves the live data alone.
+static int pchar_restore_one(struct file *filp, pchar_snap_rec_t *rec, loff_t *pos)
+{
+    struct pchar_dev *dev;
+    u32 crc;
+    int ret;
+
+    if (rec->minor >= CTL_MINOR || rec->size > FIFO_SIZE_MAX ||
+        (!(rec->mode & PCHAR_MODE_SHARDED) && rec->len > rec->size))
+        return -EBADMSG;
+
+    dev = pchar_dev_get(rec->minor);
+    if (!dev)
+    {
+        dev = pchar_dev_create(rec->minor, rec->size, rec->mode, NUMA_NO_NODE);
+        if (IS_ERR(dev))
+            return PTR_ERR(dev);
+    }
+    crc = crc32_le(~0, (void *)rec, offsetof(pchar_snap_rec_t, crc));
+    if ((dev->mode ^ rec->mode) & PCHAR_MODE_SHARDED)
+        ret = -EBADMSG;
+    else if (pchar_sharded(dev))
+        ret = pchar_restore_shards(dev, filp, rec, crc, pos);
+    else
+        ret = pchar_restore_fifo(dev, filp, rec, crc, pos);
+    if (!ret)
+    {
+        pchar_notify_writable(dev);
+        if (rec->len)
+            pchar_notify_readable(dev);
+    }
+    pchar_dev_put(dev);
+    return ret;
+}
+
+static int pchar_restore(struct file *filp)
+{
+    pchar_snap_hdr_t hdr;
+    pchar_snap_rec_t rec;
+    unsigned int count = 0;
+    size_t total = 0;
+    loff_t pos;
+    int ret;
+
+    mutex_lock(&pchar_snap_lock);
+    pos = filp->f_pos;
+    ret = snap_read(filp, &hdr, sizeof(hdr), &pos);
+    if (!ret && (hdr.magic != PCHAR_SNAP_MAGIC || hdr.version != PCHAR_SNAP_VERSION ||
+                 hdr.crc != crc32_le(~0, (void *)&hdr, offsetof(pchar_snap_hdr_t, crc))))
+        ret = -EBADMSG;
+    while (!ret)
+    {
+        ret = snap_read(filp, &rec, sizeof(rec), &pos);
+        if (ret)
+            break;
+        if (rec.minor == PCHAR_SNAP_END)
+        {
+            if (rec.crc != crc32_le(~0, (void *)&rec, offsetof(pchar_snap_rec_t, crc)))
+                ret = -EBADMSG;
+            break;
+        }
+        ret = pchar_restore_one(filp, &rec, &pos);
+        if (ret)
+            break;
+        count++;
+        total += rec.len;
+    }
+    filp->f_pos = pos;
+    mutex_unlock(&pchar_snap_lock);
+    if (ret)
+        printk(KERN_ERR "%s: restore failed after %u devices (%d).\n", THIS_MODULE->name, count, ret);
+    else
+        printk(KERN_INFO "%s: restored %u devices, %zu bytes queued.\n", THIS_MODULE->name, count, total);
+    return ret;
+}
+
+static int pchar_snapshot_path(const char *path, bool save)
+{
+    struct file *filp;
+    int ret;
+
+    filp = filp_open(path, save ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0600);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+    ret = save ? pchar_snapshot(filp) : pchar_restore(filp);
+    filp_close(filp, NULL);
+    return ret;
+}
+
+// Control device operations
+static long pchar_ctl_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    struct pchar_dev *dev;
+    struct file *filp;
+    pchar_chan_t chan;
+    pchar_link_arg_t link;
+    int minor, fd, ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    switch (cmd)
+    {
+        case PCHAR_CTL_CREATE:
+            if (copy_from_user(&chan, (void __user *)param, sizeof(chan)))
+                return -EFAULT;
+            dev = pchar_dev_create(chan.minor, chan.size, chan.mode, chan.node);
+            if (IS_ERR(dev))
+                return PTR_ERR(dev);
+            chan.minor = MINOR(dev->devno);
+            chan.size = pchar_size(dev);
+            chan.node = READ_ONCE(dev->node);
+            pchar_dev_put(dev);
+            if (copy_to_user((void __user *)param, &chan, sizeof(chan)))
+                return -EFAULT;
             return 0;
 
+        case PCHAR_CTL_DESTROY:
+            if (get_user(minor, (int __user *)param))
+                return -EFAULT;
+            return pchar_dev_destroy(minor);
+
+        case PCHAR_CTL_CONNECT:
+        case PCHAR_CTL_DISCONNECT:
+            if (copy_from_user(&link, (void __user *)param, sizeof(link)))
+                return -EFAULT;
+            if (cmd == PCHAR_CTL_CONNECT)
+                return pchar_link_add(link.src, link.dst);
+            return pchar_link_remove(link.src, link.dst);
+
+        case PCHAR_CTL_SNAPSHOT:
+        case PCHAR_CTL_RESTORE:
+            if (get_user(fd, (int __user *)param))
+                return -EFAULT;
+            filp = fget(fd);
+            if (!filp)
+                return -EBADF;
+            // a channel as target could wait on its own snapshot hold
+            if (filp->f_op == &pchar_fops)
+                ret = -EINVAL;
+            else if (cmd == PCHAR_CTL_SNAPSHOT)
+                ret = pchar_snapshot(filp);
+            else
+                ret = pchar_restore(filp);
+            fput(filp);
+            return ret;
+
         default:
-            printk(KERN_ERR "%s: Invalid ioctl command for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+            printk(KERN_ERR "%s: Invalid ioctl command for pchar_ctl.\n", THIS_MODULE->name);
             return -EINVAL;
     }
 }
 
-// File operations structure
-static struct file_operations pchar_fops = {
+static struct file_operations pchar_ctl_fops = {
     .owner = THIS_MODULE,
-    .open = pchar_open,
-    .release = pchar_close,
-    .write = pchar_write,
-    .read = pchar_read,
-    .unlocked_ioctl = pchar_ioctl
+    .unlocked_ioctl = pchar_ctl_ioctl
 };
 
+static void pchar_destroy_all(void)
+{
+    struct pchar_dev *dev;
+    unsigned long minor;
+
+    xa_for_each(&pchar_xa, minor, dev)
+        pchar_dev_destroy(minor);
+}
+
+static unsigned long pchar_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct pchar_dev *dev;
+    unsigned long minor, count = 0;
+
+    // channels in the table hold its reference, they cannot go away here
+    xa_lock(&pchar_xa);
+    xa_for_each(&pchar_xa, minor, dev)
+    {
+        if (pchar_fifo_idle(dev))
+            count++;
+    }
+    xa_unlock(&pchar_xa);
+    return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long pchar_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct pchar_dev *dev;
+    unsigned long minor = 0, freed = 0;
+
+    while (freed < sc->nr_to_scan && xa_find(&pchar_xa, &minor, CTL_MINOR - 1, XA_PRESENT))
+    {
+        dev = pchar_dev_get(minor);
+        if (dev)
+        {
+            if (pchar_fifo_release(dev))
+                freed++;
+            pchar_dev_put(dev);
+        }
+        minor++;
+    }
+    return freed ? freed : SHRINK_STOP;
+}
+
 // Initialize the devices
 static int __init pchar_init(void)
  {
     int ret, i;
     dev_t devno;
+    struct device *pdevice;
     struct pchar_dev *dev;
 
     printk(KERN_INFO "%s: pchar_init() called.\n", THIS_MODULE->name);
 
-    // Allocate a range of device numbers (major number + minor numbers for multiple devices)
-    ret = alloc_chrdev_region(&devno, 0, MAX_DEVICES, "pchar");
-    if (ret < 0) 
+    ret = pchar_core_caches_create(&caches, KBUILD_MODNAME, sizeof(struct pchar_dev), FIFO_SIZE, poolcnt);
+    if (ret)
     {
-        printk(KERN_ERR "%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
+        printk(KERN_ERR "%s: slab cache setup failed.\n", THIS_MODULE->name);
         return ret;
     }
+    pchar_fwd_wq = alloc_workqueue("pchar_fwd", WQ_UNBOUND, 0);
+    if (!pchar_fwd_wq)
+    {
+        ret = -ENOMEM;
+        goto alloc_chrdev_region_failed;
+    }
+
+    // Allocate the whole minor range, channels come and go within it
+    ret = alloc_chrdev_region(&devno, 0, MAX_MINORS, "pchar");
+    if (ret < 0)
+    {
+        printk(KERN_ERR "%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
+        goto alloc_chrdev_region_failed;
+    }
     major = MAJOR(devno);
     printk(KERN_INFO "%s: alloc_chrdev_region() device num: %d.\n", THIS_MODULE->name, major);
 
     // Create device class
-    pchar_class = class_create(THIS_MODULE, "pchar_class");
+    pchar_class = class_create("pchar_class");
     if (IS_ERR(pchar_class))
      {
         printk(KERN_ERR "%s: class_create() failed.\n", THIS_MODULE->name);
-        unregister_chrdev_region(devno, MAX_DEVICES);
-        return PTR_ERR(pchar_class);
+        ret = PTR_ERR(pchar_class);
+        goto class_create_failed;
     }
 
-    // Allocate memory for each device, initialize, and register
-    for (i = 0; i < MAX_DEVICES; i++) 
+    // Control node
+    cdev_init(&ctl_cdev, &pchar_ctl_fops);
+    ctl_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&ctl_cdev, MKDEV(major, CTL_MINOR), 1);
+    if (ret)
     {
-        dev = kzalloc(sizeof(struct pchar_dev), GFP_KERNEL);
-        if (!dev) {
-            printk(KERN_ERR "%s: kzalloc() failed for device %d.\n", THIS_MODULE->name, i);
-            ret = -ENOMEM;
-            goto err_cleanup;
-        }
+        printk(KERN_ERR "%s: cdev_add() failed for pchar_ctl.\n", THIS_MODULE->name);
+        goto ctl_cdev_failed;
+    }
+    pdevice = device_create(pchar_class, NULL, MKDEV(major, CTL_MINOR), NULL, "pchar_ctl");
+    if (IS_ERR(pdevice))
+    {
+        printk(KERN_ERR "%s: device_create() failed for pchar_ctl.\n", THIS_MODULE->name);
+        ret = PTR_ERR(pdevice);
+        goto ctl_device_failed;
+    }
 
-        // Allocate FIFO buffer for each device
-        ret = kfifo_alloc(&dev->mybuf, FIFO_SIZE, GFP_KERNEL);
-        if (ret) 
-        {
-            printk(KERN_ERR "%s: kfifo_alloc() failed for device %d.\n", THIS_MODULE->name, i);
-            kfree(dev);
-            goto err_cleanup;
-        }
+    // Channels saved by the previous instance, a bad snapshot is not fatal
+    if (snapshot && *snapshot)
+    {
+        ret = pchar_snapshot_path(snapshot, false);
+        if (ret && ret != -ENOENT)
+            printk(KERN_WARNING "%s: could not restore %s (%d).\n", THIS_MODULE->name, snapshot, ret);
+    }
 
-        // Initialize the cdev structure
-        dev->devno = MKDEV(major, i);
-        cdev_init(&dev->cdev, &pchar_fops);
-        dev->cdev.owner = THIS_MODULE;
-        ret = cdev_add(&dev->cdev, dev->devno, 1);
-        if (ret) 
+    // Initial channels not already restored
+    for (i = 0; i < devcnt && i < CTL_MINOR; i++)
+    {
+        if (xa_load(&pchar_xa, i))
+            continue;
+        dev = pchar_dev_create(i, FIFO_SIZE, 0, NUMA_NO_NODE);
+        if (IS_ERR(dev))
         {
-            printk(KERN_ERR "%s: cdev_add() failed for device %d.\n", THIS_MODULE->name, i);
-            kfifo_free(&dev->mybuf);
-            kfree(dev);
-            goto err_cleanup;
-        }
-
-        // Create device file for each device
-        if (IS_ERR(device_create(pchar_class, NULL, dev->devno, NULL, "pchar%d", i)))
-         {
-            printk(KERN_ERR "%s: device_create() failed for device %d.\n", THIS_MODULE->name, i);
-            cdev_del(&dev->cdev);
-            kfifo_free(&dev->mybuf);
-            kfree(dev);
-            goto err_cleanup;
+            ret = PTR_ERR(dev);
+            goto dev_create_failed;
         }
+        pchar_dev_put(dev);
+    }
 
-        pchar_devices[i] = dev;
+    // Idle rings are given back under memory pressure, failing that is not
+    // fatal. The shrinker is global only: rings are charged to memory cgroups
+    // but a memcg aware shrinker needs per-cgroup object tracking (list_lru)
+    // which we do not keep, so reclaim inside one cgroup's limit does not
+    // free idle rings, only global reclaim does.
+    pchar_shrinker = shrinker_alloc(0, "pchar");
+    if (pchar_shrinker)
+    {
+        pchar_shrinker->count_objects = pchar_shrink_count;
+        pchar_shrinker->scan_objects = pchar_shrink_scan;
+        shrinker_register(pchar_shrinker);
     }
+    else
+        printk(KERN_WARNING "%s: shrinker_alloc() failed, idle rings stay allocated.\n", THIS_MODULE->name);
 
     printk(KERN_INFO "%s: pchar_init() successful.\n", THIS_MODULE->name);
     return 0;
 
-err_cleanup:
-    for (i = 0; i < MAX_DEVICES; i++) 
-    {
-        if (pchar_devices[i]) 
-        {
-            cdev_del(&pchar_devices[i]->cdev);
-            kfifo_free(&pchar_devices[i]->mybuf);
-            kfree(pchar_devices[i]);
-        }
-    }
-    unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
+dev_create_failed:
+    pchar_destroy_all();
+    device_destroy(pchar_class, MKDEV(major, CTL_MINOR));
+ctl_device_failed:
+    cdev_del(&ctl_cdev);
+ctl_cdev_failed:
+    class_destroy(pchar_class);
+class_create_failed:
+    unregister_chrdev_region(MKDEV(major, 0), MAX_MINORS);
+alloc_chrdev_region_failed:
+    if (pchar_fwd_wq)
+        destroy_workqueue(pchar_fwd_wq);
+    pchar_core_caches_destroy(&caches);
     return ret;
 }
 
 // Cleanup function
 static void __exit pchar_exit(void) {
-    int i;
-
     printk(KERN_INFO "%s: pchar_exit() called.\n", THIS_MODULE->name);
+    shrinker_free(pchar_shrinker);
+
+    // no file is open any more, contents are stable
+    if (snapshot && *snapshot)
+        pchar_snapshot_path(snapshot, true);
 
     // Cleanup each device
-    for (i = 0; i < MAX_DEVICES; i++) 
-    {
-        if (pchar_devices[i]) 
-        {
-            cdev_del(&pchar_devices[i]->cdev);
-            kfifo_free(&pchar_devices[i]->mybuf);
-            device_destroy(pchar_class, pchar_devices[i]->devno);
-            kfree(pchar_devices[i]);
-        }
-    }
+    pchar_destroy_all();
+    device_destroy(pchar_class, MKDEV(major, CTL_MINOR));
+    cdev_del(&ctl_cdev);
 
     // Destroy class and release device numbers
     class_destroy(pchar_class);
-    unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
+    unregister_chrdev_region(MKDEV(major, 0), MAX_MINORS);
+    ida_destroy(&pchar_ida);
+    destroy_workqueue(pchar_fwd_wq);
+    pchar_core_caches_destroy(&caches);
     printk(KERN_INFO "%s: pchar_exit() completed.\n", THIS_MODULE->name);
 }
 
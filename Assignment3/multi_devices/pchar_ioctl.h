@@ -0,0 +1,109 @@
+#ifndef __PCHAR_IOCTL_H
+#define __PCHAR_IOCTL_H
+
+#include <linux/ioctl.h>
+
+// per channel info returned by FIFO_GETINFO; for sharded channels size and
+// len are totals over all rings and avail is what one write from the
+// calling cpu can still store
+typedef struct devinfo {
+    unsigned int size;
+    unsigned int len;
+    unsigned int avail;
+}devinfo_t;
+
+// channel modes
+#define PCHAR_MODE_BLOCK    0x01    // read blocks while empty, write while full
+// one ring of size bytes per possible cpu, each write goes to the local one as
+// a record; reads merge the rings round robin, or oldest record first with
+// PCHAR_MODE_ORDERED. Sharded channels cannot be linked.
+#define PCHAR_MODE_SHARDED  0x02
+#define PCHAR_MODE_ORDERED  0x04
+
+// argument of PCHAR_CTL_CREATE
+typedef struct pchar_chan {
+    int minor;              // in: wanted minor or -1 for any, out: assigned minor
+    unsigned int size;      // FIFO size in bytes (rounded up to power of 2), 0 for default; per cpu if sharded
+    unsigned int mode;      // PCHAR_MODE_* flags
+    int node;               // NUMA node for the channel, -1 to follow the first opener
+}pchar_chan_t;
+
+// argument of PCHAR_CTL_CONNECT / PCHAR_CTL_DISCONNECT
+typedef struct pchar_link_arg {
+    int src;                // minor whose data is forwarded
+    int dst;                // receiving minor, -1 on disconnect means all
+}pchar_link_arg_t;
+
+// snapshot stream written by PCHAR_CTL_SNAPSHOT and read by PCHAR_CTL_RESTORE:
+// one pchar_snap_hdr_t, then per channel a pchar_snap_rec_t followed by len
+// queued bytes, terminated by a record with minor == PCHAR_SNAP_END
+#define PCHAR_SNAP_MAGIC    0x50534e50  // "PNSP"
+#define PCHAR_SNAP_VERSION  1
+#define PCHAR_SNAP_END      0xffffffffu
+
+typedef struct pchar_snap_hdr {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int crc;       // crc32 of the fields above
+}pchar_snap_hdr_t;
+
+typedef struct pchar_snap_rec {
+    unsigned int minor;
+    unsigned int size;      // FIFO size in bytes
+    unsigned int mode;      // PCHAR_MODE_* flags
+    unsigned int len;       // queued bytes that follow
+    unsigned int crc;       // crc32 of the fields above and the data
+}pchar_snap_rec_t;
+
+// The len bytes of a sharded channel are one section per non-empty shard: a
+// pchar_snap_shard_t, then that shard's records as laid out in its ring
+// (a 16 byte header of u64 timestamp, u32 payload length, u32 padding, then
+// the payload). A record the reader had started is saved as its remainder.
+typedef struct pchar_snap_shard {
+    unsigned int cpu;
+    unsigned int len;       // record bytes that follow
+}pchar_snap_shard_t;
+
+// queue residency, bucket[i] counts writes whose bytes were fully read
+// [2^i, 2^(i+1)) ns after being queued
+#define PCHAR_HIST_BUCKETS  32
+typedef struct pchar_hist {
+    unsigned long long seq;             // writes so far
+    unsigned long long bucket[PCHAR_HIST_BUCKETS];
+}pchar_hist_t;
+
+// argument of PCHAR_SET_EVENTFD: the eventfd is signalled, and SIGIO sent to
+// fasync owners, each time the fill level rises to watermark bytes; it is
+// re-armed once the level drops below it again
+typedef struct pchar_evfd {
+    int fd;                 // eventfd, -1 to remove
+    unsigned int watermark; // bytes, 0 means 1
+}pchar_evfd_t;
+
+// wakeup coalescing, also in /sys/class/pchar_class/pcharN/{rd_lowat,rd_timeout_us,wr_lowat}:
+// blocked readers and poll see the device readable once rd_bytes are queued or
+// the oldest unread data is rd_usecs old (0 = no timeout); writers once
+// wr_bytes are free. Non-blocking reads and writes are not affected.
+typedef struct pchar_wmark {
+    unsigned int rd_bytes;
+    unsigned int rd_usecs;
+    unsigned int wr_bytes;
+}pchar_wmark_t;
+
+// /dev/pcharN
+#define FIFO_CLEAR          _IO('x', 1)
+#define FIFO_GETINFO        _IOR('x', 2, devinfo_t)
+#define FIFO_GETHIST        _IOR('x', 3, pchar_hist_t)
+#define PCHAR_SET_EVENTFD   _IOW('x', 8, pchar_evfd_t)
+#define PCHAR_SET_WMARK     _IOW('x', 9, pchar_wmark_t)
+#define PCHAR_GET_WMARK     _IOR('x', 10, pchar_wmark_t)
+
+// /dev/pchar_ctl
+#define PCHAR_CTL_CREATE    _IOWR('x', 16, pchar_chan_t)
+#define PCHAR_CTL_DESTROY   _IOW('x', 17, int)
+#define PCHAR_CTL_SNAPSHOT  _IOW('x', 18, int)     // arg: fd to write the stream to
+#define PCHAR_CTL_RESTORE   _IOW('x', 19, int)     // arg: fd to read the stream from
+#define PCHAR_CTL_CONNECT   _IOW('x', 20, pchar_link_arg_t)
+#define PCHAR_CTL_DISCONNECT _IOW('x', 21, pchar_link_arg_t)
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __PCHAR_IOCTL_H
+#define __PCHAR_IOCTL_H
+
+#include <linux/ioctl.h>
+// FIFO_CLEAR, FIFO_GETINFO, PCHAR_SET_EVENTFD and FIFREEZE come from pchar_core
+#include "pchar_core_ioctl.h"
+
+// start / stop draining one byte per period_ms from the FIFO
+#define FIFO_START_TIMER    _IO('x', PCHAR_CORE_IOC_NEXT)
+#define FIFO_STOP_TIMER     _IO('x', PCHAR_CORE_IOC_NEXT + 1)
+
+#endif
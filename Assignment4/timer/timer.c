@@ -1,273 +1,167 @@
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <linux/device.h>
-#include <linux/cdev.h>
-#include <linux/kfifo.h>
-#include <linux/timer.h>
-#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include "pchar_core.h"
 #include "pchar_ioctl.h"
 
 #define MAX_DEVICES 4
 #define FIFO_SIZE 32  // Size of FIFO for each device
+#define PERIOD_MIN_MS 10
+#define PERIOD_MAX_MS 60000
 
-// Device structure for each instance
-struct pchar_dev 
+// Drain state of each device, kept in its pchar_core_dev_t. The drain runs
+// from a delayed work item since the core data path sleeps on its locks.
+struct pchar_timer
 {
-    struct cdev cdev;         
-    struct kfifo mybuf;         
-    dev_t devno;               
-    struct timer_list timer;   
-    bool timer_running;         
+    pchar_core_dev_t *pdev;
+    struct mutex lock;          // protects running
+    struct delayed_work drain;
+    bool running;
 };
 
-// Global variables
-static struct pchar_dev *pchar_devices[MAX_DEVICES];
-static int major = 250;                                
-static struct class *pchar_class;                     
+static pchar_core_t *pchar_core;
 
-static void fifo_timer_callback(struct timer_list *t)
- {
-    struct pchar_dev *dev = from_timer(dev, t, timer);
-    unsigned char ch;
-    int ret;
-
-    // Remove one character from the FIFO and print it in the log
-    ret = kfifo_get(&dev->mybuf, &ch);
-    if (ret) 
-    {
-        printk(KERN_INFO "%s: Character '%c' removed from FIFO of device %d.\n", THIS_MODULE->name, ch, MINOR(dev->devno));
-    } else
-     {
-        printk(KERN_INFO "%s: FIFO is empty for device %d. Stopping the timer.\n", THIS_MODULE->name, MINOR(dev->devno));
-        del_timer_sync(&dev->timer);  // Stop the timer if the FIFO is empty
-        dev->timer_running = false;
-    }
+// drain period, changeable at runtime via /sys/module/timer/parameters/period_ms;
+// the drain picks up the new value on its next rearm; pchar_dbg() logging is
+// switched by /sys/module/pchar_core/parameters/debug
+static unsigned int period_ms = 1000;
 
-    // Restart the timer for 1 second later
-    if (dev->timer_running)
-        mod_timer(&dev->timer, jiffies + msecs_to_jiffies(1000));
-}
+static int period_ms_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int ms;
+    int ret;
 
-// Device operations
-static int pchar_open(struct inode *pinode, struct file *pfile)
- {
-    struct pchar_dev *dev = container_of(pinode->i_cdev, struct pchar_dev, cdev);
-    pfile->private_data = dev;  
-    printk(KERN_INFO "%s: pchar_open() called for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
+    ret = kstrtouint(val, 0, &ms);
+    if (ret)
+        return ret;
+    if (ms < PERIOD_MIN_MS || ms > PERIOD_MAX_MS)
+        return -EINVAL;
+    WRITE_ONCE(period_ms, ms);
+    printk(KERN_INFO "%s: timer period changed to %u ms.\n", THIS_MODULE->name, ms);
     return 0;
 }
 
-static int pchar_close(struct inode *pinode, struct file *pfile) 
-{
-    printk(KERN_INFO "%s: pchar_close() called.\n", THIS_MODULE->name);
-    return 0;
-}
+static const struct kernel_param_ops period_ms_ops = {
+    .set = period_ms_set,
+    .get = param_get_uint,
+};
+module_param_cb(period_ms, &period_ms_ops, &period_ms, 0644);
 
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t bufsize, loff_t *pf_pos) 
+static void fifo_drain_work(struct work_struct *work)
 {
-    struct pchar_dev *dev = pfile->private_data;
-    int nbytes, ret;
-    ret = kfifo_from_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0) 
+    struct pchar_timer *tm = container_of(to_delayed_work(work), struct pchar_timer, drain);
+    unsigned char ch;
+
+    mutex_lock(&tm->lock);
+    if (!tm->running)
+        goto out;
+    // Remove one character from the FIFO and print it in the log
+    if (pchar_core_drain(tm->pdev, &ch, 1))
     {
-        printk(KERN_ERR "%s: kfifo_from_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-        return ret;
+        pchar_dbg("Character '%c' removed from FIFO of device %d.\n", ch, MINOR(tm->pdev->devno));
+        // Restart the timer one period later
+        schedule_delayed_work(&tm->drain, msecs_to_jiffies(READ_ONCE(period_ms)));
+    }
+    else
+    {
+        printk(KERN_INFO "%s: FIFO is empty for device %d. Stopping the timer.\n", THIS_MODULE->name, MINOR(tm->pdev->devno));
+        tm->running = false;
     }
-    printk(KERN_INFO "%s: pchar_write() written %d bytes to device %d.\n", THIS_MODULE->name, nbytes, MINOR(dev->devno));
-    return nbytes;
+out:
+    mutex_unlock(&tm->lock);
 }
 
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t bufsize, loff_t *pf_pos) 
+static int pchar_timer_init(pchar_core_dev_t *pdev)
 {
-    struct pchar_dev *dev = pfile->private_data;
-    int ret, nbytes;
-    ret = kfifo_to_user(&dev->mybuf, ubuf, bufsize, &nbytes);
-    if (ret != 0) 
-    {
-        printk(KERN_ERR "%s: kfifo_to_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-        return ret;
-    }
-    printk(KERN_INFO "%s: pchar_read() read %d bytes from device %d.\n", THIS_MODULE->name, nbytes, MINOR(dev->devno));
-    return nbytes;
+    struct pchar_timer *tm = pchar_core_priv(pdev);
+
+    tm->pdev = pdev;
+    mutex_init(&tm->lock);
+    INIT_DELAYED_WORK(&tm->drain, fifo_drain_work);
+    tm->running = false;
+    return 0;
 }
 
-static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param) 
+static void pchar_timer_exit(pchar_core_dev_t *pdev)
 {
-    struct pchar_dev *dev = pfile->private_data;
-    devinfo_t info;
-    int ret;
+    struct pchar_timer *tm = pchar_core_priv(pdev);
 
-    switch (cmd)
-     {
-        case FIFO_CLEAR:
-            kfifo_reset(&dev->mybuf); 
-            printk(KERN_INFO "%s: pchar_ioctl() dev buffer is cleared for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-            return 0;
+    mutex_lock(&tm->lock);
+    tm->running = false;
+    mutex_unlock(&tm->lock);
+    cancel_delayed_work_sync(&tm->drain);
+}
 
-        case FIFO_GETINFO:
-            info.size = kfifo_size(&dev->mybuf);
-            info.len = kfifo_len(&dev->mybuf);
-            info.avail = kfifo_avail(&dev->mybuf);
-            ret = copy_to_user((void *)param, &info, sizeof(info));
-            if (ret < 0) 
-            {
-                printk(KERN_ERR "%s: copy_to_user() failed for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-                return ret;
-            }
-            printk(KERN_INFO "%s: pchar_ioctl() read dev buffer info for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-            return 0;
+static long pchar_timer_ioctl(pchar_core_dev_t *pdev, unsigned int cmd, unsigned long param)
+{
+    struct pchar_timer *tm = pchar_core_priv(pdev);
 
+    switch (cmd)
+    {
         case FIFO_START_TIMER:
-            if (!dev->timer_running) {
-                printk(KERN_INFO "%s: Starting timer for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-                dev->timer_running = true;
-                mod_timer(&dev->timer, jiffies + msecs_to_jiffies(1000));  // Start the timer for 1 second
+            mutex_lock(&tm->lock);
+            if (!tm->running) {
+                printk(KERN_INFO "%s: Starting timer for device %d.\n", THIS_MODULE->name, MINOR(pdev->devno));
+                tm->running = true;
+                schedule_delayed_work(&tm->drain, msecs_to_jiffies(READ_ONCE(period_ms)));  // Start the timer for one period
             }
+            mutex_unlock(&tm->lock);
             return 0;
 
         case FIFO_STOP_TIMER:
-            if (dev->timer_running)
-             {
-                printk(KERN_INFO "%s: Stopping timer for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-                del_timer_sync(&dev->timer);  // Stop the timer immediately
-                dev->timer_running = false;
+            // a drain already running sees running cleared and does not rearm
+            mutex_lock(&tm->lock);
+            if (tm->running)
+            {
+                printk(KERN_INFO "%s: Stopping timer for device %d.\n", THIS_MODULE->name, MINOR(pdev->devno));
+                tm->running = false;
+                cancel_delayed_work(&tm->drain);  // Stop the timer immediately
             }
+            mutex_unlock(&tm->lock);
             return 0;
 
         default:
-            printk(KERN_ERR "%s: Invalid ioctl command for device %d.\n", THIS_MODULE->name, MINOR(dev->devno));
-            return -EINVAL;
+            // FIFO_CLEAR, FIFO_GETINFO, FIFREEZE, PCHAR_SET_EVENTFD
+            return -ENOIOCTLCMD;
     }
 }
 
-// File operations structure
-static struct file_operations pchar_fops = {
+static const pchar_core_ops_t pchar_timer_ops = {
+    .dev_init = pchar_timer_init,
+    .dev_exit = pchar_timer_exit,
+    .ioctl = pchar_timer_ioctl,
+};
+
+static const pchar_core_desc_t pchar_timer_desc = {
     .owner = THIS_MODULE,
-    .open = pchar_open,
-    .release = pchar_close,
-    .write = pchar_write,
-    .read = pchar_read,
-    .unlocked_ioctl = pchar_ioctl
+    .name = "pchar",
+    .ndevs = MAX_DEVICES,
+    .fifo_size = FIFO_SIZE,
+    .priv_size = sizeof(struct pchar_timer),
+    .ops = &pchar_timer_ops,
 };
 
 // Initialize the devices
-static int __init pchar_init(void) 
+static int __init pchar_init(void)
 {
-    int ret, i;
-    dev_t devno;
-    struct pchar_dev *dev;
-
     printk(KERN_INFO "%s: pchar_init() called.\n", THIS_MODULE->name);
 
-    // Allocate a range of device numbers (major number + minor numbers for multiple devices)
-    ret = alloc_chrdev_region(&devno, 0, MAX_DEVICES, "pchar");
-    if (ret < 0)
-     {
-        printk(KERN_ERR "%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
-        return ret;
-    }
-    major = MAJOR(devno);
-    printk(KERN_INFO "%s: alloc_chrdev_region() device num: %d.\n", THIS_MODULE->name, major);
-
-    // Create device class
-    pchar_class = class_create(THIS_MODULE, "pchar_class");
-    if (IS_ERR(pchar_class)) 
+    // registration, data path and the common ioctls live in pchar_core
+    pchar_core = pchar_core_register(&pchar_timer_desc);
+    if (IS_ERR(pchar_core))
     {
-        printk(KERN_ERR "%s: class_create() failed.\n", THIS_MODULE->name);
-        unregister_chrdev_region(devno, MAX_DEVICES);
-        return PTR_ERR(pchar_class);
+        printk(KERN_ERR "%s: pchar_core_register() failed.\n", THIS_MODULE->name);
+        return PTR_ERR(pchar_core);
     }
-
-    // Allocate memory for each device, initialize, and register
-    for (i = 0; i < MAX_DEVICES; i++)
-     {
-        dev = kzalloc(sizeof(struct pchar_dev), GFP_KERNEL);
-        if (!dev) {
-            printk(KERN_ERR "%s: kzalloc() failed for device %d.\n", THIS_MODULE->name, i);
-            ret = -ENOMEM;
-            goto err_cleanup;
-        }
-
-        // Allocate FIFO buffer for each device
-        ret = kfifo_alloc(&dev->mybuf, FIFO_SIZE, GFP_KERNEL);
-        if (ret) {
-            printk(KERN_ERR "%s: kfifo_alloc() failed for device %d.\n", THIS_MODULE->name, i);
-            kfree(dev);
-            goto err_cleanup;
-        }
-
-        // Initialize the cdev structure
-        dev->devno = MKDEV(major, i);
-        cdev_init(&dev->cdev, &pchar_fops);
-        dev->cdev.owner = THIS_MODULE;
-        ret = cdev_add(&dev->cdev, dev->devno, 1);
-        if (ret)
-         {
-            printk(KERN_ERR "%s: cdev_add() failed for device %d.\n", THIS_MODULE->name, i);
-            kfifo_free(&dev->mybuf);
-            kfree(dev);
-            goto err_cleanup;
-        }
-
-        // Create device file
-        if (IS_ERR(device_create(pchar_class, NULL, dev->devno, NULL, "pchar%d", i))) 
-        {
-            printk(KERN_ERR "%s: device_create() failed for device %d.\n", THIS_MODULE->name, i);
-            cdev_del(&dev->cdev);
-            kfifo_free(&dev->mybuf);
-            kfree(dev);
-            goto err_cleanup;
-        }
-
-        // Initialize and set up the timer
-        timer_setup(&dev->timer, fifo_timer_callback, 0);
-        dev->timer_running = false;
-
-        // Store the device pointer in the global array
-        pchar_devices[i] = dev;
-    }
-
     return 0;
-
-err_cleanup:
-    for (i = 0; i < MAX_DEVICES; i++)
-     {
-        if (pchar_devices[i]) {
-            device_destroy(pchar_class, pchar_devices[i]->devno);
-            cdev_del(&pchar_devices[i]->cdev);
-            kfifo_free(&pchar_devices[i]->mybuf);
-            kfree(pchar_devices[i]);
-        }
-    }
-    class_destroy(pchar_class);
-    unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
-    return ret;
 }
 
 // Cleanup
-static void __exit pchar_exit(void) 
+static void __exit pchar_exit(void)
 {
-    int i;
-
     printk(KERN_INFO "%s: pchar_exit() called.\n", THIS_MODULE->name);
-
-    // Cleanup each device
-    for (i = 0; i < MAX_DEVICES; i++) 
-    {
-        if (pchar_devices[i]) 
-        {
-            if (pchar_devices[i]->timer_running)
-                del_timer_sync(&pchar_devices[i]->timer);
-
-            device_destroy(pchar_class, pchar_devices[i]->devno);
-            cdev_del(&pchar_devices[i]->cdev);
-            kfifo_free(&pchar_devices[i]->mybuf);
-            kfree(pchar_devices[i]);
-        }
-    }
-
-    class_destroy(pchar_class);
-    unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
+    pchar_core_unregister(pchar_core);
     printk(KERN_INFO "%s: pchar_exit() completed.\n", THIS_MODULE->name);
 }
 
@@ -277,4 +171,3 @@ module_exit(pchar_exit);
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Timer");
 MODULE_AUTHOR("chetna sahu <chetna7726@gmail.com>");
-
@@ -0,0 +1,732 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/jump_label.h>
+#include <linux/overflow.h>
+#include <linux/eventfd.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/mm.h>
+#include "pchar_core.h"
+#include "pchar_core_ioctl.h"
+
+struct pchar_core
+{
+    pchar_core_desc_t desc;
+    dev_t devno;                // first number of the region
+    struct class *pclass;
+    unsigned int ndevs;         // devices set up so far
+    pchar_core_dev_t *devs[];
+};
+
+// /sys/module/pchar_core/parameters/debug, shared by every driver using pchar_dbg()
+static bool debug;
+DEFINE_STATIC_KEY_FALSE(pchar_core_debug_key);
+
+static int debug_set(const char *val, const struct kernel_param *kp)
+{
+    int ret = param_set_bool(val, kp);
+    if (ret)
+        return ret;
+    if (debug)
+        static_branch_enable(&pchar_core_debug_key);
+    else
+        static_branch_disable(&pchar_core_debug_key);
+    return 0;
+}
+
+static const struct kernel_param_ops debug_ops = {
+    .set = debug_set,
+    .get = param_get_bool,
+};
+module_param_cb(debug, &debug_ops, &debug, 0644);
+
+static bool pchar_core_block(pchar_core_dev_t *pdev)
+{
+    return pdev->core->desc.flags & PCHAR_CORE_BLOCK;
+}
+
+static bool pchar_core_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static int pchar_core_lock(struct mutex *lock, struct kiocb *iocb)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(lock))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+// stop both sides, for resize and clear
+static int pchar_core_lock_all(pchar_core_dev_t *pdev)
+{
+    if (mutex_lock_interruptible(&pdev->wr_lock))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&pdev->rd_lock)) {
+        mutex_unlock(&pdev->wr_lock);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void pchar_core_unlock_all(pchar_core_dev_t *pdev)
+{
+    mutex_unlock(&pdev->rd_lock);
+    mutex_unlock(&pdev->wr_lock);
+}
+
+unsigned int pchar_core_len(pchar_core_dev_t *pdev)
+{
+    unsigned int seq, len;
+
+    // retried across a resize swapping the kfifo under us
+    do {
+        seq = read_seqcount_begin(&pdev->fifo_seq);
+        len = kfifo_len(&pdev->fifo);
+    } while (read_seqcount_retry(&pdev->fifo_seq, seq));
+    return len;
+}
+
+static bool pchar_core_full(pchar_core_dev_t *pdev)
+{
+    unsigned int seq;
+    bool full;
+
+    do {
+        seq = read_seqcount_begin(&pdev->fifo_seq);
+        full = kfifo_is_full(&pdev->fifo);
+    } while (read_seqcount_retry(&pdev->fifo_seq, seq));
+    return full;
+}
+
+// kfifo_from_user() for an iov_iter, copies straight into the free ring space;
+// the caller serializes writers, readers may run concurrently
+int pchar_core_fifo_from_iter(struct kfifo *fifo, struct iov_iter *from, unsigned int *copied)
+{
+    struct scatterlist sg[2];
+    unsigned int i, n, len, c, done = 0;
+
+    len = min_t(size_t, iov_iter_count(from), kfifo_avail(fifo));
+    sg_init_table(sg, 2);
+    n = kfifo_dma_in_prepare(fifo, sg, 2, len);
+    for (i = 0; i < n; i++) {
+        c = copy_from_iter(sg_virt(&sg[i]), sg[i].length, from);
+        done += c;
+        if (c < sg[i].length)
+            break;
+    }
+    // data before the new in index, as kfifo_in() does
+    smp_wmb();
+    kfifo_dma_in_finish(fifo, done);
+    *copied = done;
+    return (len && !done) ? -EFAULT : 0;
+}
+
+// the caller serializes readers, writers may run concurrently; copies at most max bytes
+int pchar_core_fifo_to_iter(struct kfifo *fifo, struct iov_iter *to, unsigned int max, unsigned int *copied)
+{
+    struct scatterlist sg[2];
+    unsigned int i, n, len, c, done = 0;
+
+    len = min_t(size_t, iov_iter_count(to), min(kfifo_len(fifo), max));
+    sg_init_table(sg, 2);
+    n = kfifo_dma_out_prepare(fifo, sg, 2, len);
+    for (i = 0; i < n; i++) {
+        c = copy_to_iter(sg_virt(&sg[i]), sg[i].length, to);
+        done += c;
+        if (c < sg[i].length)
+            break;
+    }
+    // finish reading the space before a writer may reuse it
+    smp_mb();
+    kfifo_dma_out_finish(fifo, done);
+    *copied = done;
+    return (len && !done) ? -EFAULT : 0;
+}
+
+void pchar_core_evt_init(pchar_core_evt_t *evt)
+{
+    spin_lock_init(&evt->lock);
+    evt->evfd = NULL;
+    evt->async_queue = NULL;
+    evt->watermark = 1;
+    evt->armed = 1;
+}
+
+void pchar_core_evt_free(pchar_core_evt_t *evt)
+{
+    if (evt->evfd)
+        eventfd_ctx_put(evt->evfd);
+    evt->evfd = NULL;
+}
+
+// after every change of the fill level, without the data path locks
+void pchar_core_evt_update(pchar_core_evt_t *evt, unsigned int (*len)(void *), void *arg)
+{
+    unsigned int wm;
+
+    // nobody to notify; evt_set and evt_fasync catch up on registration
+    if (!READ_ONCE(evt->evfd) && !READ_ONCE(evt->async_queue))
+        return;
+    wm = READ_ONCE(evt->watermark);
+    if (len(arg) < wm) {
+        set_bit(0, &evt->armed);
+        // re-arm before the recheck, so a write racing with it is not lost
+        smp_mb__after_atomic();
+    }
+    if (len(arg) < wm || !test_and_clear_bit(0, &evt->armed))
+        return;
+    spin_lock(&evt->lock);
+    if (evt->evfd)
+        eventfd_signal(evt->evfd);
+    spin_unlock(&evt->lock);
+    kill_fasync(&evt->async_queue, SIGIO, POLL_IN);
+}
+
+int pchar_core_evt_set(pchar_core_evt_t *evt, int fd, unsigned int watermark,
+                       unsigned int (*len)(void *), void *arg)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    spin_lock(&evt->lock);
+    old = evt->evfd;
+    WRITE_ONCE(evt->evfd, ctx);
+    WRITE_ONCE(evt->watermark, max(watermark, 1u));
+    spin_unlock(&evt->lock);
+    if (old)
+        eventfd_ctx_put(old);
+    // already at the new watermark counts as a crossing
+    set_bit(0, &evt->armed);
+    pchar_core_evt_update(evt, len, arg);
+    return 0;
+}
+
+int pchar_core_evt_fasync(pchar_core_evt_t *evt, int fd, struct file *pfile, int on,
+                          unsigned int (*len)(void *), void *arg)
+{
+    int ret = fasync_helper(fd, pfile, on, &evt->async_queue);
+
+    // the level was not tracked while nobody listened
+    if (ret > 0 && on)
+        pchar_core_evt_update(evt, len, arg);
+    return ret;
+}
+
+static unsigned int pchar_core_len_cb(void *arg)
+{
+    return pchar_core_len(arg);
+}
+
+static void pchar_core_changed(pchar_core_dev_t *pdev)
+{
+    pchar_core_evt_update(&pdev->evt, pchar_core_len_cb, pdev);
+}
+
+static int pchar_core_open(struct inode *pinode, struct file *pfile)
+{
+    pchar_core_dev_t *pdev = container_of(pinode->i_cdev, pchar_core_dev_t, cdev);
+    pfile->private_data = pdev;
+    pfile->f_mode |= FMODE_NOWAIT;
+    pchar_dbg("pchar_core_open() called for %s%d.\n", pdev->core->desc.name, MINOR(pdev->devno));
+    return 0;
+}
+
+static int pchar_core_fasync(int fd, struct file *pfile, int on)
+{
+    pchar_core_dev_t *pdev = pfile->private_data;
+
+    return pchar_core_evt_fasync(&pdev->evt, fd, pfile, on, pchar_core_len_cb, pdev);
+}
+
+static int pchar_core_close(struct inode *pinode, struct file *pfile)
+{
+    pchar_dbg("pchar_core_close() called.\n");
+    pchar_core_fasync(-1, pfile, 0);
+    return 0;
+}
+
+static ssize_t pchar_core_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    pchar_core_dev_t *pdev = iocb->ki_filp->private_data;
+    const pchar_core_ops_t *ops = pdev->core->desc.ops;
+    unsigned int nbytes;
+    int ret;
+
+    if (!iov_iter_count(from))
+        return 0;
+    ret = pchar_core_lock(&pdev->wr_lock, iocb);
+    if (ret)
+        return ret;
+    while (pchar_core_block(pdev) && kfifo_is_full(&pdev->fifo))
+    {
+        mutex_unlock(&pdev->wr_lock);
+        if (pchar_core_nowait(iocb))
+            return -EAGAIN;
+        if (wait_event_interruptible(pdev->wr_wq, !pchar_core_full(pdev)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&pdev->wr_lock))
+            return -ERESTARTSYS;
+    }
+    ret = pchar_core_fifo_from_iter(&pdev->fifo, from, &nbytes);
+    mutex_unlock(&pdev->wr_lock);
+    if (ret)
+        return ret;
+    pchar_dbg("pchar_core_write_iter() written %u bytes to %s%d.\n", nbytes,
+              pdev->core->desc.name, MINOR(pdev->devno));
+    if (nbytes)
+    {
+        // readers and pollers only, most writes find none
+        if (wq_has_sleeper(&pdev->rd_wq))
+            wake_up_interruptible(&pdev->rd_wq);
+        pchar_core_changed(pdev);
+        if (ops && ops->written)
+            ops->written(pdev, nbytes);
+    }
+    return nbytes;
+}
+
+static ssize_t pchar_core_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    pchar_core_dev_t *pdev = iocb->ki_filp->private_data;
+    unsigned int nbytes;
+    int ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+    ret = pchar_core_lock(&pdev->rd_lock, iocb);
+    if (ret)
+        return ret;
+    while (pchar_core_block(pdev) && kfifo_is_empty(&pdev->fifo))
+    {
+        mutex_unlock(&pdev->rd_lock);
+        if (pchar_core_nowait(iocb))
+            return -EAGAIN;
+        if (wait_event_interruptible(pdev->rd_wq, pchar_core_len(pdev)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&pdev->rd_lock))
+            return -ERESTARTSYS;
+    }
+    ret = pchar_core_fifo_to_iter(&pdev->fifo, to, UINT_MAX, &nbytes);
+    mutex_unlock(&pdev->rd_lock);
+    if (ret)
+        return ret;
+    pchar_dbg("pchar_core_read_iter() read %u bytes from %s%d.\n", nbytes,
+              pdev->core->desc.name, MINOR(pdev->devno));
+    if (nbytes)
+    {
+        if (wq_has_sleeper(&pdev->wr_wq))
+            wake_up_interruptible(&pdev->wr_wq);
+        pchar_core_changed(pdev);
+    }
+    return nbytes;
+}
+
+static __poll_t pchar_core_poll(struct file *pfile, poll_table *wait)
+{
+    pchar_core_dev_t *pdev = pfile->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(pfile, &pdev->rd_wq, wait);
+    poll_wait(pfile, &pdev->wr_wq, wait);
+    // pairs with wq_has_sleeper() on the data path, which checks lockless
+    smp_mb();
+    if (pchar_core_len(pdev))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!pchar_core_full(pdev))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+unsigned int pchar_core_drain(pchar_core_dev_t *pdev, void *buf, unsigned int len)
+{
+    unsigned int n;
+
+    mutex_lock(&pdev->rd_lock);
+    n = kfifo_out(&pdev->fifo, buf, len);
+    mutex_unlock(&pdev->rd_lock);
+    if (n)
+    {
+        if (wq_has_sleeper(&pdev->wr_wq))
+            wake_up_interruptible(&pdev->wr_wq);
+        pchar_core_changed(pdev);
+    }
+    return n;
+}
+
+int pchar_core_resize(pchar_core_dev_t *pdev, unsigned int size)
+{
+    struct scatterlist sg[2];
+    struct kfifo newbuf, old;
+    unsigned int i, n, len;
+    int ret;
+
+    if (size < PCHAR_CORE_FIFO_MIN || size > PCHAR_CORE_FIFO_MAX)
+        return -EINVAL;
+    ret = kfifo_alloc(&newbuf, size, GFP_KERNEL_ACCOUNT);
+    if (ret != 0) {
+        printk(KERN_ERR "%s: kfifo_alloc() failed with new size %u.\n", THIS_MODULE->name, size);
+        return ret;
+    }
+    // both sides stopped, no barriers needed for the copy
+    if (pchar_core_lock_all(pdev)) {
+        kfifo_free(&newbuf);
+        return -ERESTARTSYS;
+    }
+    len = kfifo_len(&pdev->fifo);
+    if (len > kfifo_size(&newbuf)) {
+        printk(KERN_ERR "%s: new size %u cannot hold %u queued bytes.\n", THIS_MODULE->name, size, len);
+        ret = -ENOSPC;
+        goto out;
+    }
+    sg_init_table(sg, 2);
+    n = kfifo_dma_out_prepare(&pdev->fifo, sg, 2, len);
+    for (i = 0; i < n; i++)
+        kfifo_in(&newbuf, sg_virt(&sg[i]), sg[i].length);
+    old = pdev->fifo;
+    write_seqcount_begin(&pdev->fifo_seq);
+    pdev->fifo = newbuf;
+    write_seqcount_end(&pdev->fifo_seq);
+    newbuf = old;
+out:
+    pchar_core_unlock_all(pdev);
+    // the old ring, or the new one if it was not used
+    kfifo_free(&newbuf);
+    if (ret == 0) {
+        printk(KERN_INFO "%s: %s%d fifo resized to %u bytes.\n", THIS_MODULE->name,
+               pdev->core->desc.name, MINOR(pdev->devno), kfifo_size(&pdev->fifo));
+        // a shrink can leave the ring full, a grow frees space
+        wake_up_interruptible(&pdev->wr_wq);
+        wake_up_interruptible(&pdev->rd_wq);
+        pchar_core_changed(pdev);
+    }
+    return ret;
+}
+
+static long pchar_core_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    pchar_core_dev_t *pdev = pfile->private_data;
+    const pchar_core_ops_t *ops = pdev->core->desc.ops;
+    pchar_evfd_t evt;
+    devinfo_t info;
+    long ret;
+
+    // the feature sees every command first, e.g. to police FIFREEZE
+    if (ops && ops->ioctl) {
+        ret = ops->ioctl(pdev, cmd, param);
+        if (ret != -ENOIOCTLCMD)
+            return ret;
+    }
+
+    switch (cmd)
+    {
+    case FIFO_CLEAR:
+        if (pchar_core_lock_all(pdev))
+            return -ERESTARTSYS;
+        kfifo_reset(&pdev->fifo);
+        pchar_core_unlock_all(pdev);
+        wake_up_interruptible(&pdev->wr_wq);
+        pchar_core_changed(pdev);
+        pchar_dbg("pchar_core_ioctl() cleared %s%d.\n", pdev->core->desc.name, MINOR(pdev->devno));
+        return 0;
+
+    case FIFO_GETINFO:
+        if (mutex_lock_interruptible(&pdev->rd_lock))
+            return -ERESTARTSYS;
+        info.size = kfifo_size(&pdev->fifo);
+        info.len = kfifo_len(&pdev->fifo);
+        info.avail = kfifo_avail(&pdev->fifo);
+        mutex_unlock(&pdev->rd_lock);
+        if (copy_to_user((void __user *)param, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+
+    case FIFREEZE:
+        if (param > PCHAR_CORE_FIFO_MAX)
+            return -EINVAL;
+        return pchar_core_resize(pdev, param);
+
+    case PCHAR_SET_EVENTFD:
+        if (copy_from_user(&evt, (void __user *)param, sizeof(evt)))
+            return -EFAULT;
+        return pchar_core_evt_set(&pdev->evt, evt.fd, evt.watermark, pchar_core_len_cb, pdev);
+
+    default:
+        printk(KERN_ERR "%s: invalid command in pchar_core_ioctl().\n", THIS_MODULE->name);
+        return -EINVAL;
+    }
+}
+
+static const struct file_operations pchar_core_fops = {
+    .owner = THIS_MODULE,
+    .open = pchar_core_open,
+    .release = pchar_core_close,
+    .read_iter = pchar_core_read_iter,
+    .write_iter = pchar_core_write_iter,
+    .poll = pchar_core_poll,
+    .fasync = pchar_core_fasync,
+    .unlocked_ioctl = pchar_core_ioctl,
+    .llseek = noop_llseek,
+};
+
+static int pchar_core_dev_add(pchar_core_t *core, unsigned int i)
+{
+    const pchar_core_ops_t *ops = core->desc.ops;
+    pchar_core_dev_t *pdev;
+    struct device *pdevice;
+    int ret;
+
+    pdev = kzalloc(sizeof(*pdev) + core->desc.priv_size, GFP_KERNEL_ACCOUNT);
+    if (!pdev)
+        return -ENOMEM;
+    pdev->core = core;
+    pdev->devno = MKDEV(MAJOR(core->devno), MINOR(core->devno) + i);
+    mutex_init(&pdev->wr_lock);
+    mutex_init(&pdev->rd_lock);
+    seqcount_mutex_init(&pdev->fifo_seq, &pdev->rd_lock);
+    init_waitqueue_head(&pdev->rd_wq);
+    init_waitqueue_head(&pdev->wr_wq);
+    pchar_core_evt_init(&pdev->evt);
+    ret = kfifo_alloc(&pdev->fifo, core->desc.fifo_size, GFP_KERNEL_ACCOUNT);
+    if (ret != 0) {
+        printk(KERN_ERR "%s: kfifo_alloc() failed for %s%u.\n", THIS_MODULE->name, core->desc.name, i);
+        goto fifo_alloc_failed;
+    }
+    if (ops && ops->dev_init) {
+        ret = ops->dev_init(pdev);
+        if (ret != 0)
+            goto dev_init_failed;
+    }
+
+    // open files pin the feature module through cdev.owner
+    cdev_init(&pdev->cdev, &pchar_core_fops);
+    pdev->cdev.owner = core->desc.owner;
+    ret = cdev_add(&pdev->cdev, pdev->devno, 1);
+    if (ret != 0) {
+        printk(KERN_ERR "%s: cdev_add() failed for %s%u.\n", THIS_MODULE->name, core->desc.name, i);
+        goto cdev_add_failed;
+    }
+    if (core->desc.ndevs == 1)
+        pdevice = device_create(core->pclass, NULL, pdev->devno, pdev, "%s", core->desc.name);
+    else
+        pdevice = device_create(core->pclass, NULL, pdev->devno, pdev, "%s%u", core->desc.name, i);
+    if (IS_ERR(pdevice)) {
+        printk(KERN_ERR "%s: device_create() failed for %s%u.\n", THIS_MODULE->name, core->desc.name, i);
+        ret = PTR_ERR(pdevice);
+        goto device_create_failed;
+    }
+    core->devs[i] = pdev;
+    return 0;
+
+device_create_failed:
+    cdev_del(&pdev->cdev);
+cdev_add_failed:
+    if (ops && ops->dev_exit)
+        ops->dev_exit(pdev);
+dev_init_failed:
+    kfifo_free(&pdev->fifo);
+fifo_alloc_failed:
+    kfree(pdev);
+    return ret;
+}
+
+static void pchar_core_dev_remove(pchar_core_t *core, pchar_core_dev_t *pdev)
+{
+    const pchar_core_ops_t *ops = core->desc.ops;
+
+    device_destroy(core->pclass, pdev->devno);
+    cdev_del(&pdev->cdev);
+    if (ops && ops->dev_exit)
+        ops->dev_exit(pdev);
+    pchar_core_evt_free(&pdev->evt);
+    kfifo_free(&pdev->fifo);
+    kfree(pdev);
+}
+
+pchar_core_t *pchar_core_register(const pchar_core_desc_t *desc)
+{
+    pchar_core_t *core;
+    int ret;
+
+    if (!desc->name || desc->ndevs == 0 || desc->ndevs > MINORMASK ||
+        desc->fifo_size < PCHAR_CORE_FIFO_MIN || desc->fifo_size > PCHAR_CORE_FIFO_MAX)
+        return ERR_PTR(-EINVAL);
+    // everything the core allocates is charged to the caller's memory cgroup
+    core = kzalloc(struct_size(core, devs, desc->ndevs), GFP_KERNEL_ACCOUNT);
+    if (!core)
+        return ERR_PTR(-ENOMEM);
+    core->desc = *desc;
+
+    ret = alloc_chrdev_region(&core->devno, 0, desc->ndevs, desc->name);
+    if (ret < 0) {
+        printk(KERN_ERR "%s: alloc_chrdev_region() failed for %s.\n", THIS_MODULE->name, desc->name);
+        goto alloc_chrdev_region_failed;
+    }
+    core->pclass = class_create(desc->name);
+    if (IS_ERR(core->pclass)) {
+        printk(KERN_ERR "%s: class_create() failed for %s.\n", THIS_MODULE->name, desc->name);
+        ret = PTR_ERR(core->pclass);
+        goto class_create_failed;
+    }
+    for (core->ndevs = 0; core->ndevs < desc->ndevs; core->ndevs++) {
+        ret = pchar_core_dev_add(core, core->ndevs);
+        if (ret != 0)
+            goto dev_add_failed;
+    }
+    printk(KERN_INFO "%s: registered %u %s devices, major %d.\n", THIS_MODULE->name,
+           core->ndevs, desc->name, MAJOR(core->devno));
+    return core;
+
+dev_add_failed:
+    while (core->ndevs > 0)
+        pchar_core_dev_remove(core, core->devs[--core->ndevs]);
+    class_destroy(core->pclass);
+class_create_failed:
+    unregister_chrdev_region(core->devno, desc->ndevs);
+alloc_chrdev_region_failed:
+    kfree(core);
+    return ERR_PTR(ret);
+}
+
+void pchar_core_unregister(pchar_core_t *core)
+{
+    while (core->ndevs > 0)
+        pchar_core_dev_remove(core, core->devs[--core->ndevs]);
+    class_destroy(core->pclass);
+    unregister_chrdev_region(core->devno, core->desc.ndevs);
+    printk(KERN_INFO "%s: unregistered %s devices.\n", THIS_MODULE->name, core->desc.name);
+    kfree(core);
+}
+
+pchar_core_dev_t *pchar_core_dev(pchar_core_t *core, unsigned int i)
+{
+    return i < core->ndevs ? core->devs[i] : NULL;
+}
+
+// fifo_pool elements come from the pool's own node
+struct pchar_core_fifo_pool
+{
+    mempool_t *pool;
+    struct kmem_cache *cache;
+    int node;
+};
+
+static void *pchar_core_pool_alloc(gfp_t gfp, void *data)
+{
+    struct pchar_core_fifo_pool *fp = data;
+    return kmem_cache_alloc_node(fp->cache, gfp, fp->node);
+}
+
+static void pchar_core_pool_free(void *mem, void *data)
+{
+    struct pchar_core_fifo_pool *fp = data;
+    kmem_cache_free(fp->cache, mem);
+}
+
+static void pchar_core_pools_destroy(pchar_core_caches_t *caches)
+{
+    int node;
+
+    if (!caches->fifo_pools)
+        return;
+    for_each_node(node)
+        mempool_destroy(caches->fifo_pools[node].pool);
+    kfree(caches->fifo_pools);
+    caches->fifo_pools = NULL;
+}
+
+int pchar_core_caches_create(pchar_core_caches_t *caches, const char *name,
+                             size_t dev_size, size_t fifo_size, int pool_min)
+{
+    struct pchar_core_fifo_pool *fp;
+    int node;
+
+    snprintf(caches->dev_name, sizeof(caches->dev_name), "%s_dev", name);
+    snprintf(caches->fifo_name, sizeof(caches->fifo_name), "%s_fifo", name);
+    caches->dev_cache = kmem_cache_create(caches->dev_name, dev_size, 0, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT, NULL);
+    if (!caches->dev_cache)
+        goto dev_cache_failed;
+    caches->fifo_cache = kmem_cache_create(caches->fifo_name, fifo_size, 0, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT, NULL);
+    if (!caches->fifo_cache)
+        goto fifo_cache_failed;
+    caches->fifo_pools = kcalloc(nr_node_ids, sizeof(*caches->fifo_pools), GFP_KERNEL);
+    if (!caches->fifo_pools)
+        goto fifo_pool_failed;
+    // every possible node, a buffer is returned to the pool of the node it sits on
+    for_each_node(node)
+    {
+        fp = &caches->fifo_pools[node];
+        fp->cache = caches->fifo_cache;
+        fp->node = node;
+        fp->pool = mempool_create_node(pool_min, pchar_core_pool_alloc, pchar_core_pool_free,
+                                       fp, GFP_KERNEL, node);
+        if (!fp->pool)
+            goto fifo_pool_failed;
+    }
+    return 0;
+
+fifo_pool_failed:
+    pchar_core_pools_destroy(caches);
+    kmem_cache_destroy(caches->fifo_cache);
+fifo_cache_failed:
+    kmem_cache_destroy(caches->dev_cache);
+dev_cache_failed:
+    printk(KERN_ERR "%s: slab cache setup failed for %s.\n", THIS_MODULE->name, name);
+    caches->fifo_cache = NULL;
+    caches->dev_cache = NULL;
+    return -ENOMEM;
+}
+
+void pchar_core_caches_destroy(pchar_core_caches_t *caches)
+{
+    pchar_core_pools_destroy(caches);
+    kmem_cache_destroy(caches->fifo_cache);
+    kmem_cache_destroy(caches->dev_cache);
+}
+
+void *pchar_core_fifo_alloc(pchar_core_caches_t *caches, int node, gfp_t gfp)
+{
+    if (node == NUMA_NO_NODE)
+        node = numa_mem_id();
+    return mempool_alloc(caches->fifo_pools[node].pool, gfp);
+}
+
+void pchar_core_fifo_free(pchar_core_caches_t *caches, void *mem)
+{
+    if (mem)
+        mempool_free(mem, caches->fifo_pools[page_to_nid(virt_to_page(mem))].pool);
+}
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Pseudo char device core");
+MODULE_AUTHOR("chetna sahu <chetna7726@gmail.com>");
+
+EXPORT_SYMBOL_GPL(pchar_core_debug_key);
+EXPORT_SYMBOL_GPL(pchar_core_register);
+EXPORT_SYMBOL_GPL(pchar_core_unregister);
+EXPORT_SYMBOL_GPL(pchar_core_dev);
+EXPORT_SYMBOL_GPL(pchar_core_drain);
+EXPORT_SYMBOL_GPL(pchar_core_resize);
+EXPORT_SYMBOL_GPL(pchar_core_len);
+EXPORT_SYMBOL_GPL(pchar_core_fifo_from_iter);
+EXPORT_SYMBOL_GPL(pchar_core_fifo_to_iter);
+EXPORT_SYMBOL_GPL(pchar_core_evt_init);
+EXPORT_SYMBOL_GPL(pchar_core_evt_free);
+EXPORT_SYMBOL_GPL(pchar_core_evt_set);
+EXPORT_SYMBOL_GPL(pchar_core_evt_fasync);
+EXPORT_SYMBOL_GPL(pchar_core_evt_update);
+EXPORT_SYMBOL_GPL(pchar_core_caches_create);
+EXPORT_SYMBOL_GPL(pchar_core_caches_destroy);
+EXPORT_SYMBOL_GPL(pchar_core_fifo_alloc);
+EXPORT_SYMBOL_GPL(pchar_core_fifo_free);
@@ -0,0 +1,143 @@
+#ifndef __PCHAR_CORE_H
+#define __PCHAR_CORE_H
+
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/jump_label.h>
+#include <linux/mempool.h>
+
+// pchar_core: registration, open/close, the kfifo data path, poll, eventfd
+// and SIGIO notification and the common ioctls (pchar_core_ioctl.h) shared
+// by the pchar drivers. A feature module describes its devices with
+// pchar_core_desc_t and adds behaviour through pchar_core_ops_t. Drivers
+// with their own data path can still use the helpers at the end.
+
+#define PCHAR_CORE_FIFO_MIN 2
+#define PCHAR_CORE_FIFO_MAX (1024 * 1024)
+
+// pchar_core_desc_t.flags
+#define PCHAR_CORE_BLOCK    0x01    // read blocks while empty, write while full
+
+// per-call logging for the data paths, a nop unless pchar_core debug=1
+DECLARE_STATIC_KEY_FALSE(pchar_core_debug_key);
+#define pchar_dbg(fmt, ...) \
+    do { \
+        if (static_branch_unlikely(&pchar_core_debug_key)) \
+            printk(KERN_INFO "%s: " fmt, THIS_MODULE->name, ##__VA_ARGS__); \
+    } while (0)
+
+// eventfd signal and SIGIO once per rise of the fill level to watermark,
+// re-armed once it drops below again
+typedef struct pchar_core_evt {
+    spinlock_t lock;            // protects evfd
+    struct eventfd_ctx *evfd;
+    struct fasync_struct *async_queue;
+    unsigned int watermark;
+    unsigned long armed;
+}pchar_core_evt_t;
+
+typedef struct pchar_core pchar_core_t;
+
+typedef struct pchar_core_dev {
+    // set up at register, read mostly
+    struct cdev cdev;
+    dev_t devno;
+    pchar_core_t *core;
+
+    // One reader and one writer may use a kfifo without locking, so readers
+    // serialize on rd_lock and writers on wr_lock; resize takes both and
+    // bumps fifo_seq so lockless length checks never see a torn swap.
+    struct mutex wr_lock ____cacheline_aligned_in_smp;
+    struct mutex rd_lock ____cacheline_aligned_in_smp;
+    struct kfifo fifo;
+    seqcount_mutex_t fifo_seq;
+
+    wait_queue_head_t rd_wq ____cacheline_aligned_in_smp;
+    wait_queue_head_t wr_wq;
+    pchar_core_evt_t evt;
+
+    // feature state, pchar_core_desc_t.priv_size bytes
+    unsigned long priv[] ____cacheline_aligned;
+}pchar_core_dev_t;
+
+typedef struct pchar_core_ops {
+    // after the ring is set up, before the device node appears
+    int (*dev_init)(pchar_core_dev_t *pdev);
+    // before the device is torn down; also on register failure after dev_init
+    void (*dev_exit)(pchar_core_dev_t *pdev);
+    // after a write queued nbytes > 0
+    void (*written)(pchar_core_dev_t *pdev, unsigned int nbytes);
+    // called before the core's own commands; -ENOIOCTLCMD passes cmd on
+    long (*ioctl)(pchar_core_dev_t *pdev, unsigned int cmd, unsigned long param);
+}pchar_core_ops_t;
+
+typedef struct pchar_core_desc {
+    struct module *owner;
+    const char *name;           // class, chrdev region and node prefix: name%d,
+                                // or just name when ndevs is 1
+    unsigned int ndevs;
+    unsigned int fifo_size;     // bytes, rounded up to a power of 2
+    unsigned int flags;         // PCHAR_CORE_* flags
+    size_t priv_size;
+    const pchar_core_ops_t *ops;
+}pchar_core_desc_t;
+
+static inline void *pchar_core_priv(pchar_core_dev_t *pdev)
+{
+    return pdev->priv;
+}
+
+pchar_core_t *pchar_core_register(const pchar_core_desc_t *desc);
+void pchar_core_unregister(pchar_core_t *core);
+pchar_core_dev_t *pchar_core_dev(pchar_core_t *core, unsigned int i);
+
+// remove up to len queued bytes into buf, waking writers; process context,
+// returns the number of bytes removed
+unsigned int pchar_core_drain(pchar_core_dev_t *pdev, void *buf, unsigned int len);
+// move the contents into a new ring of size bytes; -ENOSPC if they do not fit
+int pchar_core_resize(pchar_core_dev_t *pdev, unsigned int size);
+// queued bytes, without the locks
+unsigned int pchar_core_len(pchar_core_dev_t *pdev);
+
+// kfifo_from_user()/kfifo_to_user() for an iov_iter, copying straight between
+// the iter and the ring. One writer and one reader may run concurrently.
+int pchar_core_fifo_from_iter(struct kfifo *fifo, struct iov_iter *from, unsigned int *copied);
+int pchar_core_fifo_to_iter(struct kfifo *fifo, struct iov_iter *to, unsigned int max, unsigned int *copied);
+
+// notification for drivers with their own data path; len reads the current
+// fill level and is called without locks
+void pchar_core_evt_init(pchar_core_evt_t *evt);
+void pchar_core_evt_free(pchar_core_evt_t *evt);
+int pchar_core_evt_set(pchar_core_evt_t *evt, int fd, unsigned int watermark,
+                       unsigned int (*len)(void *), void *arg);
+int pchar_core_evt_fasync(pchar_core_evt_t *evt, int fd, struct file *pfile, int on,
+                          unsigned int (*len)(void *), void *arg);
+void pchar_core_evt_update(pchar_core_evt_t *evt, unsigned int (*len)(void *), void *arg);
+
+// Dedicated slab caches for a driver's device structs and FIFO buffers,
+// named <name>_dev and <name>_fifo so two drivers never share one; pool_min
+// buffers per NUMA node stay preallocated on that node.
+struct pchar_core_fifo_pool;
+
+typedef struct pchar_core_caches {
+    struct kmem_cache *dev_cache;
+    struct kmem_cache *fifo_cache;
+    struct pchar_core_fifo_pool *fifo_pools;   // by node id
+    char dev_name[32];          // slab keeps the name pointer
+    char fifo_name[32];
+}pchar_core_caches_t;
+
+int pchar_core_caches_create(pchar_core_caches_t *caches, const char *name,
+                             size_t dev_size, size_t fifo_size, int pool_min);
+void pchar_core_caches_destroy(pchar_core_caches_t *caches);
+// a FIFO buffer on node, NUMA_NO_NODE for the local one
+void *pchar_core_fifo_alloc(pchar_core_caches_t *caches, int node, gfp_t gfp);
+void pchar_core_fifo_free(pchar_core_caches_t *caches, void *mem);
+
+#endif
@@ -0,0 +1,180 @@
+// user space data path test for a pchar_core device (/dev/pchar from fifo.ko,
+// /dev/pcharN from timer.ko)
+// one writer thread streams a running byte counter into the device and one
+// reader thread checks every byte it gets back, so lost, duplicated or
+// reordered data shows up as errors; with resize=1 a third thread keeps
+// resizing the FIFO (FIFREEZE) underneath them
+//
+// usage: ./pchar_core_bench [device] [MiB] [blksz] [resize]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "pchar_core_ioctl.h"
+
+static const char *devpath = "/dev/pchar";
+static size_t mib = 64;
+static size_t blksz = 4096;
+static int resize;
+static volatile int done;
+
+typedef struct side {
+    pthread_t tid;
+    int fd;
+    unsigned long long bytes;
+    long errors;
+}side_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// wait for the device to become readable/writable; devices without
+// PCHAR_CORE_BLOCK return 0 or a short count instead of sleeping
+static void wait_fd(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    poll(&pfd, 1, 100);
+}
+
+static void *writer_fn(void *arg)
+{
+    side_t *s = arg;
+    unsigned long long total = (unsigned long long)mib << 20;
+    unsigned char *buf = malloc(blksz);
+    size_t i, len;
+    ssize_t n;
+
+    if(!buf) {
+        s->errors++;
+        return NULL;
+    }
+    while(s->bytes < total) {
+        len = total - s->bytes < blksz ? total - s->bytes : blksz;
+        for(i = 0; i < len; i++)
+            buf[i] = (unsigned char)(s->bytes + i);
+        n = write(s->fd, buf, len);
+        if(n < 0 && errno != EAGAIN && errno != EINTR) {
+            s->errors++;
+            break;
+        }
+        if(n <= 0) {
+            wait_fd(s->fd, POLLOUT);
+            continue;
+        }
+        // a short write leaves the rest of the pattern for the next round
+        s->bytes += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *reader_fn(void *arg)
+{
+    side_t *s = arg;
+    unsigned long long total = (unsigned long long)mib << 20;
+    unsigned char *buf = malloc(blksz);
+    ssize_t i, n;
+
+    if(!buf) {
+        s->errors++;
+        return NULL;
+    }
+    while(s->bytes < total) {
+        n = read(s->fd, buf, blksz);
+        if(n < 0 && errno != EAGAIN && errno != EINTR) {
+            s->errors++;
+            break;
+        }
+        if(n <= 0) {
+            wait_fd(s->fd, POLLIN);
+            continue;
+        }
+        for(i = 0; i < n; i++)
+            if(buf[i] != (unsigned char)(s->bytes + i))
+                s->errors++;
+        s->bytes += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+// flips between two sizes; -ENOSPC (data does not fit) is expected
+static void *resize_fn(void *arg)
+{
+    side_t *s = arg;
+    unsigned long sizes[] = { 4096, 64 << 10 };
+    int i = 0;
+
+    while(!done) {
+        if(ioctl(s->fd, FIFREEZE, sizes[i++ & 1]) < 0 && errno != ENOSPC && errno != EINTR)
+            s->errors++;
+        else
+            s->bytes++;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    side_t w = {0}, r = {0}, rs = {0};
+    devinfo_t info;
+    double t0, t;
+    int fd;
+
+    if(argc > 1)
+        devpath = argv[1];
+    if(argc > 2)
+        mib = strtoul(argv[2], NULL, 0);
+    if(argc > 3)
+        blksz = strtoul(argv[3], NULL, 0);
+    if(argc > 4)
+        resize = atoi(argv[4]);
+    if(mib == 0 || blksz == 0) {
+        fprintf(stderr, "usage: %s [device] [MiB] [blksz] [resize]\n", argv[0]);
+        return 1;
+    }
+
+    fd = open(devpath, O_RDWR);
+    if(fd < 0) {
+        perror(devpath);
+        return 1;
+    }
+    // start from an empty FIFO so the pattern lines up
+    if(ioctl(fd, FIFO_CLEAR) < 0 || ioctl(fd, FIFO_GETINFO, &info) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+    printf("%s: fifo size %u, %zu MiB in %zu byte blocks%s\n", devpath, info.size,
+           mib, blksz, resize ? ", resizing" : "");
+
+    w.fd = r.fd = rs.fd = fd;
+    t0 = now_sec();
+    pthread_create(&r.tid, NULL, reader_fn, &r);
+    pthread_create(&w.tid, NULL, writer_fn, &w);
+    if(resize)
+        pthread_create(&rs.tid, NULL, resize_fn, &rs);
+    pthread_join(w.tid, NULL);
+    pthread_join(r.tid, NULL);
+    t = now_sec() - t0;
+    done = 1;
+    if(resize)
+        pthread_join(rs.tid, NULL);
+
+    printf("%10.1f MiB/s  written %llu  read %llu  resizes %llu  errors %ld\n",
+           r.bytes / t / (1 << 20), w.bytes, r.bytes, rs.bytes, w.errors + r.errors + rs.errors);
+    close(fd);
+    return (w.errors + r.errors + rs.errors) ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __PCHAR_CORE_IOCTL_H
+#define __PCHAR_CORE_IOCTL_H
+
+#include <linux/ioctl.h>
+
+// commands handled by pchar_core for every device registered with it;
+// feature modules number their own commands from PCHAR_CORE_IOC_NEXT up,
+// skipping 8 (PCHAR_SET_EVENTFD)
+
+// per device info returned by FIFO_GETINFO
+typedef struct devinfo {
+    unsigned int size;
+    unsigned int len;
+    unsigned int avail;
+}devinfo_t;
+
+// argument of PCHAR_SET_EVENTFD: the eventfd is signalled, and SIGIO sent to
+// fasync owners, each time the fill level rises to watermark bytes; it is
+// re-armed once the level drops below it again
+typedef struct pchar_evfd {
+    int fd;                 // eventfd, -1 to remove
+    unsigned int watermark; // bytes, 0 means 1
+}pchar_evfd_t;
+
+#define FIFO_CLEAR          _IO('x', 1)
+#define FIFO_GETINFO        _IOR('x', 2, devinfo_t)
+#define PCHAR_SET_EVENTFD   _IOW('x', 8, pchar_evfd_t)
+// FIFREEZE (linux/fs.h) with the new size as argument resizes the FIFO,
+// keeping queued data; sizes are rounded up to a power of 2
+#define PCHAR_CORE_IOC_NEXT 3
+
+#endif